@@ -0,0 +1,326 @@
+
+/*
+Copyright (C) 2012 Antonio Zea, akzeac@gmail.com, Karlsruhe Institute of Technology
+This code borrows heavily from code by Nicklas Gavelin, nicklas.gavelin@gmail.com,
+Luleå University of Technology
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <cctype>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include "libSphero.h"
+
+namespace LibSphero {
+
+static const char *CACHE_HEADER = "# libSphero capabilities 1";
+
+Capabilities::Capabilities() :
+	hasVersion(false),
+	hasBluetoothInfo(false),
+	updated(0) {
+	memset(&version, 0, sizeof(version));
+}
+
+bool Capabilities::parseVersion(const Response::Message &message) {
+	Response::VersionView view(message);
+	if (message.getResponseCode() != Response::Code::OK || !view.isValid()) {
+		return false;
+	}
+
+	version.record = view.getRecordVersion();
+	version.model = view.getModel();
+	version.hardware = view.getHardware();
+	version.mainApp = view.getMainApp();
+	version.mainAppRevision = view.getMainAppRevision();
+	version.bootloader = view.getBootloader();
+	version.basic = view.getBasic();
+	version.macro = view.getMacro();
+	version.apiMajor = view.getApiMajor();
+	version.apiMinor = view.getApiMinor();
+	hasVersion = true;
+	updated = time(0);
+	return true;
+}
+
+bool Capabilities::parseBluetoothInfo(const Response::Message &message) {
+	Response::BluetoothInfoView view(message);
+	if (message.getResponseCode() != Response::Code::OK || !view.isValid()) {
+		return false;
+	}
+
+	name.clear();
+	for (size_t i = 0; i < view.getNameLength(); i++) {
+		name += isprint(view.getName()[i]) ? view.getName()[i] : ' ';
+	}
+	bluetoothAddress.clear();
+	for (size_t i = 0; i < Response::BluetoothInfoView::ADDRESS_LENGTH; i++) {
+		if (i > 0 && i % 2 == 0) {
+			bluetoothAddress += ':';
+		}
+		bluetoothAddress += (char) toupper(view.getAddress()[i]);
+	}
+	hasBluetoothInfo = true;
+	updated = time(0);
+	return true;
+}
+
+CapabilityCache::CapabilityCache(const std::string &_path) :
+	path(_path) {
+	load();
+}
+
+CapabilityCache::~CapabilityCache() {
+}
+
+bool CapabilityCache::get(const std::string &address, Capabilities &capabilities) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	for (size_t i = 0; i < entries.size(); i++) {
+		if (entries[i].first == address) {
+			capabilities = entries[i].second;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool CapabilityCache::put(const std::string &address, const Capabilities &capabilities) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t i = 0;
+		while (i < entries.size() && entries[i].first != address) {
+			i++;
+		}
+		if (i == entries.size()) {
+			entries.push_back(std::make_pair(address, capabilities));
+		} else {
+			entries[i].second = capabilities;
+		}
+	}
+	return save();
+}
+
+bool CapabilityCache::load() {
+	FILE *file = fopen(path.c_str(), "r");
+	if (!file) {
+		return false;
+	}
+
+	std::vector<std::pair<std::string, Capabilities> > loaded;
+	char line[256];
+	bool valid = fgets(line, sizeof(line), file)
+			&& strncmp(line, CACHE_HEADER, strlen(CACHE_HEADER)) == 0;
+
+	while (valid && fgets(line, sizeof(line), file)) {
+		char address[32];
+		char bluetoothAddress[32];
+		long long updated;
+		unsigned int hasVersion, hasBluetoothInfo, fields[10];
+		int nameStart = 0;
+
+		if (sscanf(line, "%31s %lld %u %u %u %u %u %u %u %u %u %u %u %u %31s %n",
+				address, &updated, &hasVersion,
+				&fields[0], &fields[1], &fields[2], &fields[3], &fields[4],
+				&fields[5], &fields[6], &fields[7], &fields[8], &fields[9],
+				&hasBluetoothInfo, bluetoothAddress, &nameStart) < 15 || nameStart == 0) {
+			continue;
+		}
+
+		Capabilities capabilities;
+		capabilities.updated = updated;
+		capabilities.hasVersion = hasVersion != 0;
+		capabilities.version.record = fields[0];
+		capabilities.version.model = fields[1];
+		capabilities.version.hardware = fields[2];
+		capabilities.version.mainApp = fields[3];
+		capabilities.version.mainAppRevision = fields[4];
+		capabilities.version.bootloader = fields[5];
+		capabilities.version.basic = fields[6];
+		capabilities.version.macro = fields[7];
+		capabilities.version.apiMajor = fields[8];
+		capabilities.version.apiMinor = fields[9];
+		capabilities.hasBluetoothInfo = hasBluetoothInfo != 0;
+		if (capabilities.hasBluetoothInfo) {
+			capabilities.bluetoothAddress = bluetoothAddress;
+			capabilities.name = line + nameStart;
+			capabilities.name.erase(capabilities.name.find_last_not_of("\r\n") + 1);
+		}
+		loaded.push_back(std::make_pair(std::string(address), capabilities));
+	}
+	fclose(file);
+
+	if (!valid) {
+		std::cout << "CapabilityCache: Failed to read " << path << "!" << std::endl;
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	entries.swap(loaded);
+	return true;
+}
+
+bool CapabilityCache::save() const {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// Written next to the file and renamed, so readers never see half of it
+	std::string temporary = path + ".tmp";
+	FILE *file = fopen(temporary.c_str(), "w");
+	if (!file) {
+		std::cout << "CapabilityCache: Failed to write " << temporary << "!" << std::endl;
+		return false;
+	}
+
+	fprintf(file, "%s\n", CACHE_HEADER);
+	for (size_t i = 0; i < entries.size(); i++) {
+		const Capabilities &capabilities = entries[i].second;
+		const VersionInfo &version = capabilities.version;
+		fprintf(file, "%s %lld %u %u %u %u %u %u %u %u %u %u %u %u %s %s\n",
+				entries[i].first.c_str(), (long long) capabilities.updated,
+				capabilities.hasVersion ? 1 : 0,
+				version.record, version.model, version.hardware,
+				version.mainApp, version.mainAppRevision, version.bootloader,
+				version.basic, version.macro, version.apiMajor, version.apiMinor,
+				capabilities.hasBluetoothInfo ? 1 : 0,
+				capabilities.hasBluetoothInfo ? capabilities.bluetoothAddress.c_str() : "-",
+				capabilities.name.c_str());
+	}
+
+	bool written = fflush(file) == 0 && !ferror(file);
+	written = fclose(file) == 0 && written;
+	if (!written || rename(temporary.c_str(), path.c_str()) != 0) {
+		std::cout << "CapabilityCache: Failed to write " << path << "!" << std::endl;
+		remove(temporary.c_str());
+		return false;
+	}
+	return true;
+}
+
+CapabilityProbe::CapabilityProbe(Robot &_robot, CapabilityCache &_cache,
+		unsigned int _maxAge) :
+	robot(_robot),
+	cache(_cache),
+	maxAge(_maxAge),
+	versionSeqNum(-1),
+	bluetoothSeqNum(-1) {
+	robot.addListener(*this);
+}
+
+CapabilityProbe::~CapabilityProbe() {
+	robot.removeListener(*this);
+}
+
+bool CapabilityProbe::start() {
+	Capabilities cached;
+	bool found = cache.get(robot.getAddress(), cached);
+	bool fresh = found && cached.isComplete()
+			&& time(0) - cached.updated <= (int64_t) maxAge;
+
+	if (found) {
+		update(cached);
+	}
+	if (!fresh) {
+		refresh();
+	}
+	return fresh;
+}
+
+void CapabilityProbe::refresh() {
+	if (!robot.isConnected()) {
+		return;
+	}
+
+	// Recorded first, so the responses cannot overtake the records. The
+	// listener needs the mutex, so it is not held during the writes.
+	int version = robot.reserveSequenceNumber();
+	int bluetooth = robot.reserveSequenceNumber();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		versionSeqNum = version;
+		bluetoothSeqNum = bluetooth;
+	}
+
+	bool versionSent = robot.send(Macro::version(), version) != -1;
+	bool bluetoothSent = robot.send(Macro::getBluetoothInfo(), bluetooth) != -1;
+
+	// Queries the queue rejected are not waited for
+	if (!versionSent || !bluetoothSent) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!versionSent && versionSeqNum == version) {
+			versionSeqNum = -1;
+		}
+		if (!bluetoothSent && bluetoothSeqNum == bluetooth) {
+			bluetoothSeqNum = -1;
+		}
+		changed.notify_all();
+	}
+}
+
+Capabilities CapabilityProbe::getCapabilities() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return capabilities;
+}
+
+bool CapabilityProbe::waitForCapabilities(unsigned int timeout) {
+	std::unique_lock<std::mutex> lock(mutex);
+	return changed.wait_for(lock, std::chrono::milliseconds(timeout),
+			[this] { return capabilities.isComplete()
+					&& versionSeqNum == -1 && bluetoothSeqNum == -1; });
+}
+
+void CapabilityProbe::update(const Capabilities &updated) {
+	std::lock_guard<std::mutex> lock(mutex);
+	capabilities = updated;
+	changed.notify_all();
+}
+
+void CapabilityProbe::onPacketReceived(const Response::Message &message) {
+	if (message.getResponseType() != Response::Type::REGULAR) {
+		return;
+	}
+
+	Capabilities updated;
+	bool finished;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		int seqNum = message.getSequenceNumber();
+		if (seqNum == versionSeqNum) {
+			versionSeqNum = -1;
+			updated = capabilities;
+			if (!updated.parseVersion(message)) {
+				return;
+			}
+		} else if (seqNum == bluetoothSeqNum) {
+			bluetoothSeqNum = -1;
+			updated = capabilities;
+			if (!updated.parseBluetoothInfo(message)) {
+				return;
+			}
+		} else {
+			return;
+		}
+		capabilities = updated;
+		finished = versionSeqNum == -1 && bluetoothSeqNum == -1;
+		changed.notify_all();
+	}
+
+	// Saved once both answers are in, so the file is written once per refresh
+	if (finished && updated.isComplete()) {
+		cache.put(robot.getAddress(), updated);
+	}
+}
+
+}
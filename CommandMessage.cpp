@@ -57,7 +57,7 @@ static uint8_t getCommandLength(int dataLength) {
 static uint8_t getCommandId(MessageType command) {
 	switch(command) {
 	case MessageType::PING:
-		return 0;
+		return 1;
 	case MessageType::VERSIONING:
 		return 2;
 	case MessageType::SET_BLUETOOTH_NAME:
@@ -184,6 +184,25 @@ void Message::packetize(ByteArrayBuffer &buffer, int seqNum) const {
 	buffer[(packet_length - CHECKSUM_LENGTH)] = (uint8_t) (checksum ^ 0xFFFFFFFF);
 }
 
+size_t Message::getHeaderLength() {
+	return COMMAND_HEADER_LENGTH;
+}
+
+static void patchByte(uint8_t *packet, size_t length, size_t index, uint8_t value) {
+	// The checksum is the inverted sum, so the difference is applied reversed
+	uint8_t &checksum = packet[length - CHECKSUM_LENGTH];
+	checksum = (uint8_t) (checksum + packet[index] - value);
+	packet[index] = value;
+}
+
+void Message::patchSequenceNumber(uint8_t *packet, size_t length, int seqNum) {
+	patchByte(packet, length, INDEX_COMMAND_SEQUENCE_NO, (uint8_t) seqNum);
+}
+
+void Message::patchPayload(uint8_t *packet, size_t length, size_t index, uint8_t value) {
+	patchByte(packet, length, COMMAND_HEADER_LENGTH + index, value);
+}
+
 
 std::ostream &operator<<(std::ostream &os, MessageType type) {
 	switch(type) {
@@ -0,0 +1,517 @@
+
+/*
+Copyright (C) 2012 Antonio Zea, akzeac@gmail.com, Karlsruhe Institute of Technology
+This code borrows heavily from code by Nicklas Gavelin, nicklas.gavelin@gmail.com,
+Luleå University of Technology
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "libSphero.h"
+#include "Tracing.h"
+
+namespace LibSphero {
+
+/* Fields of a ROLL payload */
+static const size_t ROLL_SPEED_INDEX = 0;
+static const size_t ROLL_HEADING_INDEX = 1;
+static const size_t ROLL_GO_INDEX = 3;
+
+/* Fields of an RGB_LED_OUTPUT payload */
+static const size_t LED_RED_INDEX = 0;
+static const size_t LED_GREEN_INDEX = 1;
+static const size_t LED_BLUE_INDEX = 2;
+
+Fleet::Fleet() :
+	sendTimeout(1000) {
+}
+
+Fleet::~Fleet() {
+	for (Robot *robot : robots) {
+		robot->fleet = 0;
+	}
+}
+
+void Fleet::add(Robot &robot) {
+	if (robot.fleet != this) {
+		if (robot.fleet) {
+			robot.fleet->remove(robot);
+		}
+		robots.push_back(&robot);
+		heartbeats.push_back(0);
+
+		headings.push_back(0);
+		velocities.push_back(0);
+		reds.push_back(0);
+		greens.push_back(0);
+		blues.push_back(0);
+		stopped.push_back(0);
+		connected.push_back(0);
+		lastResponses.push_back(0);
+
+		// From now on the robot keeps its entries current
+		robot.fleet = this;
+		robot.fleetIndex = robots.size() - 1;
+		robot.storeInFleet();
+	}
+}
+
+void Fleet::remove(Robot &robot) {
+	std::vector<Robot*>::iterator it = std::find(robots.begin(), robots.end(), &robot);
+	if (it != robots.end()) {
+		size_t index = it - robots.begin();
+		robot.fleet = 0;
+		robots.erase(it);
+		for (size_t i = index; i < robots.size(); i++) {
+			robots[i]->fleetIndex = i;
+		}
+		heartbeats.erase(heartbeats.begin() + index);
+
+		headings.erase(headings.begin() + index);
+		velocities.erase(velocities.begin() + index);
+		reds.erase(reds.begin() + index);
+		greens.erase(greens.begin() + index);
+		blues.erase(blues.begin() + index);
+		stopped.erase(stopped.begin() + index);
+		connected.erase(connected.begin() + index);
+		lastResponses.erase(lastResponses.begin() + index);
+	}
+}
+
+void Fleet::store(size_t index) {
+	const Robot &robot = *robots[index];
+	headings[index] = robot.state.heading;
+	velocities[index] = robot.state.velocity;
+	reds[index] = robot.state.red;
+	greens[index] = robot.state.green;
+	blues[index] = robot.state.blue;
+	stopped[index] = robot.state.stop ? 1 : 0;
+	connected[index] = robot.isConnected() ? 1 : 0;
+	lastResponses[index] = robot.lastResponse;
+}
+
+namespace {
+
+/** A connection attempt in progress */
+struct Attempt {
+	size_t index;
+	unsigned int number;
+	int fd;
+	std::chrono::steady_clock::time_point deadline;
+};
+
+}
+
+size_t Fleet::connect(const std::vector<std::string> &addresses,
+		const ConnectOptions &options, IConnectionListener *listener) {
+	typedef std::chrono::steady_clock Clock;
+
+	std::deque<std::pair<size_t, unsigned int> > queue;
+	for (size_t i = 0; i < robots.size() && i < addresses.size(); i++) {
+		if (!robots[i]->isConnected()) {
+			queue.push_back(std::make_pair(i, 1u));
+		}
+	}
+
+	std::vector<Attempt> active;
+	std::vector<pollfd> fds;
+
+	while (!queue.empty() || !active.empty()) {
+		while (!queue.empty() && (options.maxConcurrent == 0
+				|| active.size() < options.maxConcurrent)) {
+			size_t index = queue.front().first;
+			unsigned int number = queue.front().second;
+			queue.pop_front();
+
+			Robot &robot = *robots[index];
+			if (listener) {
+				listener->onConnecting(robot, number);
+			}
+
+			int fd = robot.openSocket(addresses[index]);
+			if (fd != -1) {
+				// Like Robot::connect, a timeout of 0 waits forever
+				Attempt attempt = { index, number, fd, options.timeout == 0 ?
+						Clock::time_point::max() :
+						Clock::now() + std::chrono::milliseconds(options.timeout) };
+				active.push_back(attempt);
+			} else if (number < options.attempts) {
+				queue.push_back(std::make_pair(index, number + 1));
+			} else if (listener) {
+				listener->onConnectFailed(robot);
+			}
+		}
+
+		if (active.empty()) {
+			continue;
+		}
+
+		Clock::time_point now = Clock::now();
+		Clock::time_point nearest = active[0].deadline;
+		fds.clear();
+		for (size_t k = 0; k < active.size(); k++) {
+			fds.push_back({ active[k].fd, POLLOUT, 0 });
+			nearest = std::min(nearest, active[k].deadline);
+		}
+
+		int timeout = 0;
+		if (nearest == Clock::time_point::max()) {
+			timeout = -1;
+		} else if (nearest > now) {
+			timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+					nearest - now).count() + 1;
+		}
+
+		if (::poll(&fds[0], fds.size(), timeout) == -1 && errno != EINTR) {
+			std::cout << "Fleet: Failed to poll!" << std::endl;
+
+			// Nothing more can be waited for, so the attempts in progress fail
+			for (size_t k = 0; k < active.size(); k++) {
+				close(active[k].fd);
+				if (listener) {
+					listener->onConnectFailed(*robots[active[k].index]);
+				}
+			}
+			for (size_t k = 0; k < queue.size(); k++) {
+				if (listener) {
+					listener->onConnectFailed(*robots[queue[k].first]);
+				}
+			}
+			break;
+		}
+
+		now = Clock::now();
+		size_t remaining = 0;
+		for (size_t k = 0; k < active.size(); k++) {
+			Attempt &attempt = active[k];
+			Robot &robot = *robots[attempt.index];
+
+			bool connected = false;
+			if (fds[k].revents != 0) {
+				connected = robot.finishConnect(attempt.fd, false);
+				robot.connectionWanted = connected;
+			} else if (now >= attempt.deadline) {
+				if (robot.debug) {
+					std::cout << "Robot: Connection to '" << robot.getAddress()
+							<< "' timed out!" << std::endl;
+				}
+				close(attempt.fd);
+			} else {
+				active[remaining++] = attempt;
+				continue;
+			}
+
+			if (connected) {
+				if (listener) {
+					listener->onConnected(robot);
+				}
+			} else if (attempt.number < options.attempts) {
+				queue.push_back(std::make_pair(attempt.index, attempt.number + 1));
+			} else if (listener) {
+				listener->onConnectFailed(robot);
+			}
+		}
+		active.resize(remaining);
+	}
+
+	size_t connected = 0;
+	for (size_t i = 0; i < robots.size(); i++) {
+		if (robots[i]->isConnected()) {
+			connected++;
+		}
+	}
+	return connected;
+}
+
+template<typename Patch>
+size_t Fleet::transmit(const Command::Message &message, Patch patch,
+		const RetryPolicy *policy) {
+	ByteArrayBuffer packet;
+	message.packetize(packet, 0);
+
+	size_t length = packet.size();
+	images.resize(robots.size() * length);
+	for (size_t i = 0; i < robots.size(); i++) {
+		uint8_t *image = &images[i * length];
+		std::copy(packet.begin(), packet.end(), image);
+		patch(i, image, length);
+	}
+
+	return transmit(message, length, policy);
+}
+
+size_t Fleet::broadcast(const Command::Message &message) {
+	return transmit(message, [](size_t, uint8_t*, size_t) {});
+}
+
+size_t Fleet::setLEDColor(uint8_t red, uint8_t green, uint8_t blue) {
+	return broadcast(Macro::RGBLED(red, green, blue));
+}
+
+size_t Fleet::stop(const RetryPolicy &policy) {
+	// Every robot keeps its own heading, so only those bytes differ. The
+	// arrays also know about commands sent directly to the robots.
+	return transmit(Macro::roll(0, 0, true),
+			[this](size_t i, uint8_t *image, size_t length) {
+				int heading = headings[i];
+				Command::Message::patchPayload(image, length,
+						ROLL_HEADING_INDEX, (uint8_t)(heading >> 8));
+				Command::Message::patchPayload(image, length,
+						ROLL_HEADING_INDEX + 1, (uint8_t)heading);
+			}, &policy);
+}
+
+size_t Fleet::roll(const int *newHeadings, const uint8_t *speeds) {
+	return transmit(Macro::roll(0, 0, false),
+			[newHeadings, speeds](size_t i, uint8_t *image, size_t length) {
+				int heading = ((newHeadings[i] % 360) + 360) % 360;
+				Command::Message::patchPayload(image, length,
+						ROLL_SPEED_INDEX, speeds[i]);
+				Command::Message::patchPayload(image, length,
+						ROLL_HEADING_INDEX, (uint8_t)(heading >> 8));
+				Command::Message::patchPayload(image, length,
+						ROLL_HEADING_INDEX + 1, (uint8_t)heading);
+			});
+}
+
+size_t Fleet::setHeadings(const int *newHeadings) {
+	return transmit(Macro::roll(0, 0, false),
+			[this, newHeadings](size_t i, uint8_t *image, size_t length) {
+				int heading = ((newHeadings[i] % 360) + 360) % 360;
+				Command::Message::patchPayload(image, length,
+						ROLL_SPEED_INDEX, velocities[i]);
+				Command::Message::patchPayload(image, length,
+						ROLL_HEADING_INDEX, (uint8_t)(heading >> 8));
+				Command::Message::patchPayload(image, length,
+						ROLL_HEADING_INDEX + 1, (uint8_t)heading);
+
+				// A robot that was stopped stays stopped
+				if (stopped[i]) {
+					Command::Message::patchPayload(image, length, ROLL_GO_INDEX, 0);
+				}
+			});
+}
+
+size_t Fleet::setLEDColors(const uint8_t *red, const uint8_t *green, const uint8_t *blue) {
+	return transmit(Macro::RGBLED(0, 0, 0),
+			[red, green, blue](size_t i, uint8_t *image, size_t length) {
+				Command::Message::patchPayload(image, length, LED_RED_INDEX, red[i]);
+				Command::Message::patchPayload(image, length, LED_GREEN_INDEX, green[i]);
+				Command::Message::patchPayload(image, length, LED_BLUE_INDEX, blue[i]);
+			});
+}
+
+size_t Fleet::transmit(const Command::Message &message, size_t length,
+		const RetryPolicy *policy) {
+	const size_t header = Command::Message::getHeaderLength();
+
+	offsets.assign(robots.size(), length);
+	size_t delivered = 0;
+
+	// Other threads may be sending to the same robots meanwhile
+	std::vector<std::unique_lock<std::mutex> > locks;
+	locks.reserve(robots.size());
+
+	// Finish every packet before the first write, to keep the skew low
+	for (size_t i = 0; i < robots.size(); i++) {
+		Robot &robot = *robots[i];
+		locks.push_back(std::unique_lock<std::mutex>(robot.sendMutex));
+		if (!robot.isConnected()) {
+			continue;
+		}
+		// A full queue is reported instead of stalling the other robots
+		if (!robot.simulation && !robot.reserve(false)) {
+			continue;
+		}
+
+		// A link still finishing a packet from an earlier broadcast is skipped
+		if (!robot.simulation && !robot.sendQueue.enabled
+				&& (!robot.flushQueue() || !robot.txQueue.empty())) {
+			continue;
+		}
+
+		uint8_t *image = &images[i * length];
+		uint8_t seqNum = robot.reserveSequenceNumber();
+		Command::Message::patchSequenceNumber(image, length, seqNum);
+		robot.updateInternalValues(message.getCommand(), image + header);
+		robot.requests[seqNum] = message.getCommand();
+		robot.supersede(message.getCommand());
+
+		// Tracked before the write, with the payload of this robot
+		if (policy) {
+			robot.track(Command::Message(message.getCommand(),
+					ByteArrayBuffer(image + header, image + length - 1)),
+					*policy, seqNum);
+		}
+		SPHERO_PROBE3(send, (int) message.getCommand(), seqNum, length);
+
+		// Emulated robots take the packet at once
+		if (robot.simulation) {
+			robot.simulation->transmit(robot, image, length);
+			delivered++;
+			continue;
+		}
+
+		// As do robots with a send queue, which must not be overtaken
+		if (robot.sendQueue.enabled) {
+			if (robot.writePacket(image, length)) {
+				delivered++;
+			}
+			continue;
+		}
+		offsets[i] = 0;
+	}
+
+	// Non-blocking writes, so a slow link does not delay the others
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()
+			+ std::chrono::milliseconds(sendTimeout);
+	std::vector<pollfd> pending;
+	std::vector<size_t> indices;
+
+	for (size_t i = 0; i < robots.size(); i++) {
+		if (offsets[i] != length) {
+			pending.push_back({ robots[i]->socket, POLLOUT, 0 });
+			indices.push_back(i);
+		}
+	}
+
+	bool firstPass = true;
+
+	while (!pending.empty()) {
+		for (size_t k = 0; k < pending.size(); k++) {
+			size_t i = indices[k];
+			if (!firstPass && pending[k].revents == 0) {
+				continue;
+			}
+
+			const uint8_t *image = &images[i * length];
+			ssize_t written = ::send(pending[k].fd, image + offsets[i],
+					length - offsets[i], MSG_DONTWAIT | MSG_NOSIGNAL);
+
+			if (written == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+				std::cout << "Fleet: Failed to write to '"
+						<< robots[i]->getAddress() << "'!" << std::endl;
+				offsets[i] = length;
+				pending[k].fd = -1;
+			} else if (written > 0) {
+				offsets[i] += written;
+				if (offsets[i] == length) {
+					if (robots[i]->debug) {
+						ByteArrayBuffer packet(image, image + length);
+						std::cout << ">> " << message.getCommand() << ": "
+								<< packet << std::endl;
+					}
+					pending[k].fd = -1;
+					delivered++;
+				}
+			}
+		}
+
+		size_t remaining = 0;
+		for (size_t k = 0; k < pending.size(); k++) {
+			if (pending[k].fd != -1) {
+				pending[remaining] = pending[k];
+				pending[remaining].revents = 0;
+				indices[remaining] = indices[k];
+				remaining++;
+			}
+		}
+		pending.resize(remaining);
+		indices.resize(remaining);
+		firstPass = false;
+
+		if (pending.empty()) {
+			break;
+		}
+
+		std::chrono::steady_clock::duration left = deadline - std::chrono::steady_clock::now();
+		if (left.count() <= 0) {
+			abandon(indices, length);
+			break;
+		}
+
+		int timeout = std::chrono::duration_cast<std::chrono::milliseconds>(left).count() + 1;
+		if (::poll(&pending[0], pending.size(), timeout) == -1 && errno != EINTR) {
+			std::cout << "Fleet: Failed to poll!" << std::endl;
+			abandon(indices, length);
+			break;
+		}
+	}
+
+	return delivered;
+}
+
+void Fleet::abandon(const std::vector<size_t> &indices, size_t length) {
+	for (size_t k = 0; k < indices.size(); k++) {
+		size_t i = indices[k];
+		Robot &robot = *robots[i];
+		if (robot.debug) {
+			std::cout << "Fleet: Timed out writing to '" << robot.getAddress()
+					<< "'!" << std::endl;
+		}
+
+		// The stored state already holds the command, and a partly written
+		// frame would be lost, so the robot's listener writes the rest
+		const uint8_t *image = &images[i * length];
+		robot.txQueue.push_back(ByteArrayBuffer(image, image + length));
+		robot.txOffset = offsets[i];
+		robot.txQueued = robot.txQueue.size();
+		robot.wake();
+	}
+}
+
+void Fleet::setHeartbeat(Robot &robot, const Heartbeat *heartbeat) {
+	std::vector<Robot*>::iterator it = std::find(robots.begin(), robots.end(), &robot);
+	if (it != robots.end()) {
+		heartbeats[it - robots.begin()] = heartbeat;
+	}
+}
+
+size_t Fleet::sendAt(const Command::Message &message,
+		std::chrono::steady_clock::time_point when) {
+	typedef std::chrono::steady_clock Clock;
+
+	// Robots with the slowest links are sent to first
+	std::vector<std::pair<Clock::time_point, Robot*> > sends;
+	for (size_t i = 0; i < robots.size(); i++) {
+		double latency = heartbeats[i] ? heartbeats[i]->getQuality().latency : 0;
+		sends.push_back(std::make_pair(when - std::chrono::duration_cast<Clock::duration>(
+				std::chrono::duration<double, std::milli>(latency)), robots[i]));
+	}
+	std::stable_sort(sends.begin(), sends.end(),
+			[](const std::pair<Clock::time_point, Robot*> &a,
+					const std::pair<Clock::time_point, Robot*> &b) {
+				return a.first < b.first;
+			});
+
+	size_t sent = 0;
+	for (size_t i = 0; i < sends.size(); i++) {
+		std::this_thread::sleep_until(sends[i].first);
+		if (sends[i].second->isConnected() && sends[i].second->send(message) >= 0) {
+			sent++;
+		}
+	}
+	return sent;
+}
+
+}
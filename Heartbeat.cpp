@@ -0,0 +1,180 @@
+
+/*
+Copyright (C) 2012 Antonio Zea, akzeac@gmail.com, Karlsruhe Institute of Technology
+This code borrows heavily from code by Nicklas Gavelin, nicklas.gavelin@gmail.com,
+Luleå University of Technology
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <algorithm>
+#include <cmath>
+#include "libSphero.h"
+
+namespace LibSphero {
+
+Heartbeat::Heartbeat(Robot &_robot, const HeartbeatOptions &_options,
+		ILinkQualityListener *_listener) :
+	robot(_robot),
+	options(_options),
+	listener(_listener),
+	degraded(false),
+	running(false) {
+	quality.rtt = 0;
+	quality.jitter = 0;
+	quality.loss = 0;
+	quality.latency = 0;
+	quality.sent = 0;
+	quality.received = 0;
+	quality.lost = 0;
+}
+
+Heartbeat::~Heartbeat() {
+	stop();
+}
+
+void Heartbeat::start() {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!running) {
+		running = true;
+		robot.addListener(*this);
+		thread = std::thread(&Heartbeat::run, this);
+	}
+}
+
+void Heartbeat::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!running) {
+			return;
+		}
+		running = false;
+	}
+
+	wakeup.notify_all();
+	thread.join();
+	robot.removeListener(*this);
+}
+
+LinkQuality Heartbeat::getQuality() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return quality;
+}
+
+bool Heartbeat::isDegraded() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return degraded;
+}
+
+void Heartbeat::run() {
+	std::unique_lock<std::mutex> lock(mutex);
+	Clock::time_point next = Clock::now();
+
+	while (running) {
+		Clock::time_point now = Clock::now();
+		Clock::duration timeout = std::chrono::milliseconds(options.timeout);
+
+		while (!pending.empty() && now - pending.front().sent > timeout) {
+			pending.pop_front();
+			update(lock, 0, true);
+		}
+
+		if (running && robot.isConnected()) {
+			// Recorded first, so the response cannot overtake the record. The
+			// listener needs the mutex, so it is not held during the write.
+			Ping ping;
+			ping.sent = Clock::now();
+			ping.seqNum = robot.reserveSequenceNumber();
+
+			pending.push_back(ping);
+			quality.sent++;
+
+			lock.unlock();
+			robot.send(Macro::ping(), ping.seqNum);
+			lock.lock();
+		}
+
+		// Deadlines are absolute, so the rate does not drift
+		next += std::chrono::milliseconds(options.period);
+		if (next < now) {
+			next = now;
+		}
+		wakeup.wait_until(lock, next, [this] { return !running; });
+	}
+
+	pending.clear();
+}
+
+void Heartbeat::onPacketReceived(const Response::Message &message) {
+	if (message.getResponseType() != Response::Type::REGULAR) {
+		return;
+	}
+
+	Clock::time_point now = Clock::now();
+	std::unique_lock<std::mutex> lock(mutex);
+
+	for (std::deque<Ping>::iterator it = pending.begin(); it != pending.end(); ++it) {
+		if (it->seqNum == message.getSequenceNumber()) {
+			double rtt = std::chrono::duration<double, std::milli>(now - it->sent).count();
+			pending.erase(it);
+			update(lock, rtt, false);
+			return;
+		}
+	}
+}
+
+void Heartbeat::update(std::unique_lock<std::mutex> &lock, double rtt, bool lost) {
+	const double gain = options.gain;
+
+	if (lost) {
+		quality.lost++;
+	} else {
+		if (quality.received == 0) {
+			quality.rtt = rtt;
+		} else {
+			quality.jitter += gain * (std::fabs(rtt - quality.rtt) - quality.jitter);
+			quality.rtt += gain * (rtt - quality.rtt);
+		}
+		quality.received++;
+
+		// The fastest round trip is the one least delayed by queueing
+		samples.push_back(rtt);
+		while (samples.size() > std::max(options.window, 1u)) {
+			samples.pop_front();
+		}
+		quality.latency = *std::min_element(samples.begin(), samples.end()) / 2;
+	}
+	quality.loss += gain * ((lost ? 1.0 : 0.0) - quality.loss);
+
+	bool exceeded = quality.rtt > options.maxRtt
+			|| quality.jitter > options.maxJitter
+			|| quality.loss > options.maxLoss;
+
+	if (exceeded != degraded) {
+		degraded = exceeded;
+		if (listener) {
+			LinkQuality current = quality;
+			lock.unlock();
+			if (exceeded) {
+				listener->onLinkDegraded(robot, current);
+			} else {
+				listener->onLinkRecovered(robot, current);
+			}
+			lock.lock();
+		}
+	}
+}
+
+}
@@ -0,0 +1,341 @@
+
+/*
+Copyright (C) 2012 Antonio Zea, akzeac@gmail.com, Karlsruhe Institute of Technology
+This code borrows heavily from code by Nicklas Gavelin, nicklas.gavelin@gmail.com,
+Luleå University of Technology
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Measures the time from Robot::send to the acknowledgement, against an
+ * emulated robot at the other end of a socketpair. Every combination of
+ * payload, streaming load and concurrency is run for a fixed time.
+ *
+ * Usage: LatencyBenchmark [seconds per run] [commands per second, 0 for
+ * as fast as possible] */
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "libSphero.h"
+
+using namespace LibSphero;
+
+typedef std::chrono::steady_clock Clock;
+
+/* Fields of a command packet */
+static const size_t DEVICE_ID_INDEX = 2;
+static const size_t COMMAND_ID_INDEX = 3;
+static const size_t SEQUENCE_NUMBER_INDEX = 4;
+static const size_t LENGTH_INDEX = 5;
+static const size_t HEADER_LENGTH = 6;
+
+/* Streaming is recognized by its device and command IDs */
+static const uint8_t STREAMING_DEVICE = 2;
+static const uint8_t STREAMING_COMMAND = 17;
+
+/* Values per streamed frame: the filtered accelerometer and gyroscope */
+static const size_t STREAMED_CHANNELS = 6;
+
+/** Robot at the other end of the socketpair. Every command is answered
+ * at once, and sensor data is streamed at the requested rate. */
+class EmulatedRobot {
+private:
+	int fd;
+	std::thread thread;
+	std::atomic<bool> running;
+
+	static void appendChecksum(ByteArrayBuffer &packet) {
+		uint8_t sum = 0;
+		for (size_t i = 2; i < packet.size(); i++) {
+			sum += packet[i];
+		}
+		packet.push_back(~sum);
+	}
+
+	bool write(const ByteArrayBuffer &packet) {
+		size_t offset = 0;
+		while (offset < packet.size()) {
+			// The robot may have closed its end already
+			ssize_t written = ::send(fd, &packet[offset], packet.size() - offset, MSG_NOSIGNAL);
+			if (written <= 0) {
+				return false;
+			}
+			offset += written;
+		}
+		return true;
+	}
+
+	void run() {
+		ByteArrayBuffer received;
+		ByteArrayBuffer data(STREAMED_CHANNELS * 2, 0);
+		Clock::duration period = Clock::duration::zero();
+		Clock::time_point next = Clock::now();
+		uint8_t buffer[4096];
+
+		while (running) {
+			int timeout = -1;
+			if (period != Clock::duration::zero()) {
+				timeout = std::max<int64_t>(0, std::chrono::duration_cast<
+						std::chrono::milliseconds>(next - Clock::now()).count());
+			}
+
+			struct pollfd pfd = { fd, POLLIN, 0 };
+			if (::poll(&pfd, 1, std::min(timeout, 100)) == -1 && errno != EINTR) {
+				return;
+			}
+
+			if (pfd.revents & POLLIN) {
+				ssize_t n = read(fd, buffer, sizeof(buffer));
+				if (n <= 0) {
+					return;
+				}
+				received.insert(received.end(), buffer, buffer + n);
+			}
+
+			size_t offset = 0;
+			while (received.size() - offset >= HEADER_LENGTH
+					&& received.size() - offset >= HEADER_LENGTH + received[offset + LENGTH_INDEX]) {
+				const uint8_t *command = &received[offset];
+				offset += HEADER_LENGTH + command[LENGTH_INDEX];
+
+				if (command[DEVICE_ID_INDEX] == STREAMING_DEVICE
+						&& command[COMMAND_ID_INDEX] == STREAMING_COMMAND) {
+					int divisor = (command[HEADER_LENGTH] << 8) + command[HEADER_LENGTH + 1];
+					period = divisor == 0 ? Clock::duration::zero() :
+							std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(
+									(double) divisor / SensorData::BASE_RATE));
+					next = Clock::now();
+				}
+
+				ByteArrayBuffer response = { 0xFF, 0xFF, 0, command[SEQUENCE_NUMBER_INDEX], 1 };
+				appendChecksum(response);
+				if (!write(response)) {
+					return;
+				}
+			}
+			received.erase(received.begin(), received.begin() + offset);
+
+			if (period != Clock::duration::zero() && Clock::now() >= next) {
+				ByteArrayBuffer packet = { 0xFF, 0xFE, 3, 0, (uint8_t)(data.size() + 1) };
+				packet.insert(packet.end(), data.begin(), data.end());
+				appendChecksum(packet);
+				if (!write(packet)) {
+					return;
+				}
+				next += period;
+			}
+		}
+	}
+
+public:
+	EmulatedRobot(int _fd) :
+		fd(_fd),
+		running(true) {
+		thread = std::thread(&EmulatedRobot::run, this);
+	}
+
+	~EmulatedRobot() {
+		running = false;
+		shutdown(fd, SHUT_RDWR);
+		thread.join();
+		close(fd);
+	}
+};
+
+/** Matches acknowledgements to the send times of the commands in flight */
+class LatencyRecorder : public IListener {
+private:
+	/** The acknowledgement can be processed before the send is recorded */
+	enum Slot {
+		IDLE, SENT, ACKNOWLEDGED
+	};
+
+	std::mutex mutex;
+	std::condition_variable acknowledged;
+	Slot slots[256];
+	Clock::time_point times[256];
+	size_t inFlight;
+	std::vector<double> latencies;
+
+	void record(Clock::time_point sent, Clock::time_point received) {
+		latencies.push_back(std::chrono::duration<double, std::micro>(
+				received - sent).count());
+	}
+
+public:
+	LatencyRecorder() :
+		inFlight(0) {
+		std::fill(slots, slots + 256, IDLE);
+	}
+
+	/** Waits until fewer than the given number of commands are in flight */
+	void waitBelow(size_t concurrency) {
+		std::unique_lock<std::mutex> lock(mutex);
+		acknowledged.wait(lock, [this, concurrency] { return inFlight < concurrency; });
+	}
+
+	/** Waits up to a second for the commands in flight */
+	void drain() {
+		std::unique_lock<std::mutex> lock(mutex);
+		acknowledged.wait_for(lock, std::chrono::seconds(1), [this] { return inFlight == 0; });
+	}
+
+	/** Sends a command, recording when it was sent. The lock is not held
+	 * while writing, as the listener must keep reading meanwhile. */
+	void send(Robot &robot, const Command::Message &message) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			inFlight++;
+		}
+
+		Clock::time_point sent = Clock::now();
+		int seqNum = robot.send(message);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (slots[seqNum] == ACKNOWLEDGED) {
+			record(sent, times[seqNum]);
+			slots[seqNum] = IDLE;
+			inFlight--;
+			acknowledged.notify_all();
+		} else {
+			slots[seqNum] = SENT;
+			times[seqNum] = sent;
+		}
+	}
+
+	/** Returns the latencies in microseconds, sorted */
+	std::vector<double> takeLatencies() {
+		std::lock_guard<std::mutex> lock(mutex);
+		std::vector<double> sorted;
+		sorted.swap(latencies);
+		std::sort(sorted.begin(), sorted.end());
+		return sorted;
+	}
+
+	virtual void onPacketReceived(const Response::Message &message) {
+		if (message.getResponseType() != Response::Type::REGULAR
+				|| message.getSequenceNumber() < 0) {
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		int seqNum = message.getSequenceNumber();
+		if (slots[seqNum] == SENT) {
+			record(times[seqNum], message.getTimestamp());
+			slots[seqNum] = IDLE;
+			inFlight--;
+			acknowledged.notify_all();
+		} else if (inFlight > 0) {
+			slots[seqNum] = ACKNOWLEDGED;
+			times[seqNum] = message.getTimestamp();
+		}
+	}
+};
+
+static double percentile(const std::vector<double> &sorted, double fraction) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	size_t index = std::min(sorted.size() - 1, (size_t)(fraction * sorted.size()));
+	return sorted[index];
+}
+
+int main(int argc, char **argv) {
+	double seconds = argc > 1 ? atof(argv[1]) : 2;
+	double rate = argc > 2 ? atof(argv[2]) : 0;
+
+	struct Payload {
+		const char *name;
+		Command::Message message;
+	};
+	const Payload payloads[] = {
+		{ "roll", Macro::roll(90, 100, false) },
+		{ "led", Macro::RGBLED(255, 128, 0) },
+		{ "name", Macro::setRobotName("Benchmark") },
+	};
+	const size_t concurrencies[] = { 1, 16 };
+	const int streamingMask = Macro::ACCELEROMETER_X_FILTERED
+			| Macro::ACCELEROMETER_Y_FILTERED | Macro::ACCELEROMETER_Z_FILTERED
+			| Macro::GYRO_X_FILTERED | Macro::GYRO_Y_FILTERED | Macro::GYRO_Z_FILTERED;
+
+	std::cout << std::left << std::setw(8) << "payload" << std::setw(11) << "streaming"
+			<< std::setw(13) << "concurrency" << std::right << std::setw(10) << "commands"
+			<< std::setw(12) << "per second" << std::setw(10) << "p50 us"
+			<< std::setw(10) << "p99 us" << std::setw(10) << "p999 us" << std::endl;
+
+	for (const Payload &payload : payloads) {
+		for (int streaming = 0; streaming < 2; streaming++) {
+			for (size_t concurrency : concurrencies) {
+				int fds[2];
+				if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+					std::cout << "LatencyBenchmark: Failed to create socketpair!" << std::endl;
+					return 1;
+				}
+
+				EmulatedRobot emulated(fds[1]);
+				Robot robot;
+				LatencyRecorder recorder;
+				robot.connectSocket(fds[0], "emulated");
+				std::thread listener([&robot, &recorder] { robot.listen(recorder); });
+
+				if (streaming) {
+					robot.send(Macro::setDataStreaming(1, 1, streamingMask, 0));
+				}
+				robot.delay(100);
+				recorder.takeLatencies();
+
+				Clock::time_point start = Clock::now();
+				Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(
+						std::chrono::duration<double>(seconds));
+				size_t count = 0;
+
+				for (Clock::time_point now = start; now < end; now = Clock::now()) {
+					if (rate > 0) {
+						std::this_thread::sleep_until(start + std::chrono::duration_cast<Clock::duration>(
+								std::chrono::duration<double>(count / rate)));
+					}
+					recorder.waitBelow(concurrency);
+					recorder.send(robot, payload.message);
+					count++;
+				}
+				recorder.drain();
+				double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+				robot.stopListening();
+				listener.join();
+				robot.disconnect();
+
+				std::vector<double> latencies = recorder.takeLatencies();
+				std::cout << std::left << std::setw(8) << payload.name
+						<< std::setw(11) << (streaming ? "400 Hz" : "off")
+						<< std::setw(13) << concurrency << std::right << std::fixed
+						<< std::setprecision(0) << std::setw(10) << latencies.size()
+						<< std::setw(12) << latencies.size() / elapsed
+						<< std::setprecision(1) << std::setw(10) << percentile(latencies, 0.5)
+						<< std::setw(10) << percentile(latencies, 0.99)
+						<< std::setw(10) << percentile(latencies, 0.999) << std::endl;
+			}
+		}
+	}
+
+	return 0;
+}
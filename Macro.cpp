@@ -48,6 +48,10 @@ Command::Message Macro::setFrontLED(uint8_t brightness) {
 	};
 }
 
+Command::Message Macro::ping() {
+	return {Command::MessageType::PING};
+}
+
 Command::Message Macro::getBluetoothInfo() {
 	return {Command::MessageType::GET_BLUETOOTH_INFO};
 }
@@ -128,6 +132,16 @@ Command::Message Macro::runMacro(uint8_t macroId) {
 	};
 }
 
+Command::Message Macro::saveMacro(uint8_t macroId, const ByteArrayBuffer &macro) {
+	Command::Message message(Command::MessageType::SAVE_MACRO);
+	ByteArrayBuffer &buffer = message.getPayload();
+
+	buffer.push_back(macroId);
+	buffer.insert(buffer.end(), macro.begin(), macro.end());
+
+	return message;
+}
+
 Command::Message Macro::setDataStreaming(uint16_t mDivisor, uint16_t mPacketFrames,
 		int mSensorMask, uint8_t mPacketCount) {
 	return {
@@ -0,0 +1,320 @@
+
+/*
+Copyright (C) 2012 Antonio Zea, akzeac@gmail.com, Karlsruhe Institute of Technology
+This code borrows heavily from code by Nicklas Gavelin, nicklas.gavelin@gmail.com,
+Luleå University of Technology
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <cstring>
+#include <inttypes.h>
+#include <iostream>
+#include "libSphero.h"
+
+namespace LibSphero {
+
+static const char *CACHE_HEADER = "# libSphero macros 1";
+
+/* Longest macro that fits in a packet next to its ID */
+static const size_t MAX_MACRO_LENGTH = 253;
+
+static const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ULL;
+static const uint64_t FNV_PRIME = 1099511628211ULL;
+
+MacroCache::MacroCache(const std::string &_path) :
+	path(_path) {
+	load();
+}
+
+MacroCache::~MacroCache() {
+}
+
+uint64_t MacroCache::hash(const ByteArrayBuffer &macro) {
+	uint64_t value = FNV_OFFSET_BASIS;
+	for (uint8_t byte : macro) {
+		value = (value ^ byte) * FNV_PRIME;
+	}
+	return value;
+}
+
+uint32_t MacroCache::getFirmware(const VersionInfo &version) {
+	return (version.mainApp << 16) | (version.mainAppRevision << 8) | version.macro;
+}
+
+bool MacroCache::contains(const std::string &address, uint8_t macroId, uint64_t hash,
+		uint32_t firmware) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	for (const Entry &entry : entries) {
+		if (entry.address == address && entry.macroId == macroId) {
+			return entry.hash == hash && entry.firmware == firmware;
+		}
+	}
+	return false;
+}
+
+bool MacroCache::put(const std::string &address, uint8_t macroId, uint64_t hash,
+		uint32_t firmware) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t i = 0;
+		while (i < entries.size() && (entries[i].address != address
+				|| entries[i].macroId != macroId)) {
+			i++;
+		}
+		if (i == entries.size()) {
+			Entry entry = { address, macroId, hash, firmware };
+			entries.push_back(entry);
+		} else {
+			entries[i].hash = hash;
+			entries[i].firmware = firmware;
+		}
+	}
+	return save();
+}
+
+bool MacroCache::remove(const std::string &address, uint8_t macroId) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (size_t i = 0; i < entries.size(); i++) {
+			if (entries[i].address == address && entries[i].macroId == macroId) {
+				entries.erase(entries.begin() + i);
+				break;
+			}
+		}
+	}
+	return save();
+}
+
+bool MacroCache::clear(const std::string &address) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (size_t i = 0; i < entries.size(); ) {
+			if (entries[i].address == address) {
+				entries.erase(entries.begin() + i);
+			} else {
+				i++;
+			}
+		}
+	}
+	return save();
+}
+
+bool MacroCache::load() {
+	FILE *file = fopen(path.c_str(), "r");
+	if (!file) {
+		return false;
+	}
+
+	std::vector<Entry> loaded;
+	char line[256];
+	bool valid = fgets(line, sizeof(line), file)
+			&& strncmp(line, CACHE_HEADER, strlen(CACHE_HEADER)) == 0;
+
+	while (valid && fgets(line, sizeof(line), file)) {
+		char address[32];
+		unsigned int macroId, firmware;
+		uint64_t hash;
+
+		if (sscanf(line, "%31s %u %" SCNx64 " %x", address, &macroId, &hash, &firmware) < 4
+				|| macroId > 255) {
+			continue;
+		}
+
+		Entry entry = { address, (uint8_t) macroId, hash, firmware };
+		loaded.push_back(entry);
+	}
+	fclose(file);
+
+	if (!valid) {
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	entries.swap(loaded);
+	return true;
+}
+
+bool MacroCache::save() const {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// Written next to the file and renamed, so readers never see half of it
+	std::string temporary = path + ".tmp";
+	FILE *file = fopen(temporary.c_str(), "w");
+	if (!file) {
+		std::cout << "MacroCache: Failed to write " << temporary << "!" << std::endl;
+		return false;
+	}
+
+	fprintf(file, "%s\n", CACHE_HEADER);
+	for (const Entry &entry : entries) {
+		fprintf(file, "%s %u %016" PRIx64 " %x\n", entry.address.c_str(),
+				entry.macroId, entry.hash, entry.firmware);
+	}
+
+	bool written = fflush(file) == 0 && !ferror(file);
+	written = fclose(file) == 0 && written;
+	if (!written || rename(temporary.c_str(), path.c_str()) != 0) {
+		std::cout << "MacroCache: Failed to write " << path << "!" << std::endl;
+		::remove(temporary.c_str());
+		return false;
+	}
+	return true;
+}
+
+MacroLoader::MacroLoader(Robot &_robot, MacroCache &_cache, uint32_t _firmware) :
+	robot(_robot),
+	cache(_cache),
+	firmware(_firmware),
+	uploads(0),
+	running(true) {
+	thread = std::thread(&MacroLoader::work, this);
+	robot.addListener(*this);
+}
+
+MacroLoader::~MacroLoader() {
+	robot.removeListener(*this);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		running = false;
+	}
+	wakeup.notify_all();
+	thread.join();
+}
+
+bool MacroLoader::run(uint8_t macroId, const ByteArrayBuffer &macro) {
+	if (macro.size() > MAX_MACRO_LENGTH) {
+		std::cout << "MacroLoader: Macro " << (int) macroId << " is too long!" << std::endl;
+		return false;
+	}
+
+	uint64_t hash = MacroCache::hash(macro);
+	bool stored = cache.contains(robot.getAddress(), macroId, hash, firmware);
+
+	// A cached run keeps the macro, in case the robot lost it
+	start(macroId, hash, macro, !stored, stored);
+	return !stored;
+}
+
+unsigned int MacroLoader::getUploads() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return uploads;
+}
+
+void MacroLoader::start(uint8_t macroId, uint64_t hash, const ByteArrayBuffer &macro,
+		bool upload, bool retry) {
+	Pending save = { -1, true, macroId, hash, ByteArrayBuffer() };
+	Pending run = { -1, false, macroId, hash, retry ? macro : ByteArrayBuffer() };
+
+	// Recorded first, so the responses cannot overtake the records. The
+	// listener needs the mutex, so it is not held during the writes.
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (upload) {
+			save.seqNum = robot.reserveSequenceNumber();
+			record(save);
+		}
+		run.seqNum = robot.reserveSequenceNumber();
+		record(run);
+	}
+
+	if (upload) {
+		bool sent = robot.send(Macro::saveMacro(macroId, macro), save.seqNum) != -1;
+		std::lock_guard<std::mutex> lock(mutex);
+		if (sent) {
+			uploads++;
+		} else {
+			forget(save.seqNum);
+		}
+	}
+
+	if (robot.send(Macro::runMacro(macroId), run.seqNum) == -1) {
+		std::lock_guard<std::mutex> lock(mutex);
+		forget(run.seqNum);
+	}
+}
+
+void MacroLoader::record(const Pending &entry) {
+	// Responses that never came are forgotten once the number comes round
+	forget(entry.seqNum);
+	pending.push_back(entry);
+}
+
+void MacroLoader::forget(int seqNum) {
+	for (size_t i = 0; i < pending.size(); i++) {
+		if (pending[i].seqNum == seqNum) {
+			pending.erase(pending.begin() + i);
+			break;
+		}
+	}
+}
+
+void MacroLoader::work() {
+	std::unique_lock<std::mutex> lock(mutex);
+
+	// Answers still waiting are handled first, so no upload goes unrecorded
+	while (running || !answers.empty()) {
+		if (answers.empty()) {
+			wakeup.wait(lock);
+			continue;
+		}
+
+		Answer answer = answers.front();
+		answers.pop_front();
+		bool retry = running;
+		lock.unlock();
+
+		const Pending &command = answer.command;
+		if (command.upload && answer.ok) {
+			cache.put(robot.getAddress(), command.macroId, command.hash, firmware);
+		} else if (command.upload) {
+			cache.remove(robot.getAddress(), command.macroId);
+		} else {
+			// The robot has lost the macro, most likely in a reset, so it is
+			// uploaded again. The run is not retried a second time.
+			cache.remove(robot.getAddress(), command.macroId);
+			if (retry) {
+				start(command.macroId, command.hash, command.macro, true, false);
+			}
+		}
+
+		lock.lock();
+	}
+}
+
+void MacroLoader::onPacketReceived(const Response::Message &message) {
+	if (message.getResponseType() != Response::Type::REGULAR) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	size_t i = 0;
+	while (i < pending.size() && pending[i].seqNum != message.getSequenceNumber()) {
+		i++;
+	}
+	if (i == pending.size()) {
+		return;
+	}
+
+	// Only uploads and failed runs of cached macros need more work
+	Answer answer = { pending[i], message.getResponseCode() == Response::Code::OK };
+	pending.erase(pending.begin() + i);
+	if (answer.command.upload || (!answer.ok && !answer.command.macro.empty())) {
+		answers.push_back(answer);
+		wakeup.notify_one();
+	}
+}
+
+}
@@ -19,6 +19,8 @@ License along with this library; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
+#include <algorithm>
+#include <cstring>
 #include "libSphero.h"
 
 namespace LibSphero {
@@ -36,6 +38,9 @@ static const size_t RESPONSE_HEADER_LENGTH = 5;
 static const size_t INFORMATION_RESPONSE_TYPE_INDEX = 2;
 static const size_t	INFORMATION_RESPONSE_CODE_INDEX = 3;
 
+/* Asynchronous packets have room for a two byte length */
+static const size_t INFORMATION_LENGTH_MSB_INDEX = 3;
+
 static Response::Code findResponseCode(uint8_t a, Response::Type type) {
 	if (type == Type::REGULAR) {
 		switch (a) {
@@ -95,18 +100,36 @@ static Response::InformationCode findInformationResponseCode(uint8_t c) {
 		return InformationCode::EMIT;
 	} else if (c == 3) {
 		return InformationCode::DATA;
+	} else if (c == 2) {
+		return InformationCode::DIAGNOSTICS;
+	} else if (c == 4) {
+		return InformationCode::CONFIGURATION_BLOCK;
 	} else {
 		return InformationCode::INVALID;
 	}
 }
 
+static size_t findPayloadLength(const uint8_t *source, Response::Type type) {
+	if (type == Type::INFORMATION) {
+		return (source[INFORMATION_LENGTH_MSB_INDEX] << 8) | source[PAYLOAD_LENGTH_INDEX];
+	} else {
+		return source[PAYLOAD_LENGTH_INDEX];
+	}
+}
+
 Message::Message() {
 	code = Code::INVALID;
 	type = Type::UNKNOWN;
+	command = Command::MessageType::INVALID;
 }
 
-Message::Message(const ByteArrayBuffer &source) {
+Message::Message(const ByteArrayBuffer &source) :
+	Message(&source[0], source.size()) {
+}
+
+Message::Message(const uint8_t *source, size_t length) {
 	type = findResponseType(source[0], source[1]);
+	command = Command::MessageType::INVALID;
 
 	if (type == Type::UNKNOWN) {
 		code = Code::ERROR_BAD_MESSAGE;
@@ -117,11 +140,9 @@ Message::Message(const ByteArrayBuffer &source) {
 				INFORMATION_RESPONSE_CODE_INDEX : RESPONSE_CODE_INDEX;
 		code = findResponseCode(source[responseIndex], type);
 
-		size_t totalLength = RESPONSE_HEADER_LENGTH + source[PAYLOAD_LENGTH_INDEX];
-		packet.resize(totalLength);
-		std::copy(source.begin(),
-				source.begin() + totalLength,
-				packet.begin());
+		size_t totalLength = std::min(length,
+				RESPONSE_HEADER_LENGTH + findPayloadLength(source, type));
+		packet.assign(source, source + totalLength);
 	}
 }
 
@@ -153,7 +174,7 @@ size_t Message::getPayloadLength() const {
 	if (packet.size() <= PAYLOAD_LENGTH_INDEX) {
 		return 0;
 	} else {
-		return packet[PAYLOAD_LENGTH_INDEX];
+		return findPayloadLength(&packet[0], type);
 	}
 }
 
@@ -193,12 +214,16 @@ InformationCode Message::getInformationCode() const {
 }
 
 bool Message::containsValidPacket(const ByteArrayBuffer &data) {
-	if (data.size() < RESPONSE_HEADER_LENGTH) {
+	return containsValidPacket(data.empty() ? 0 : &data[0], data.size());
+}
+
+bool Message::containsValidPacket(const uint8_t *data, size_t length) {
+	if (length < RESPONSE_HEADER_LENGTH) {
 		return false;
 	}
 
-	size_t dataLength = data[PAYLOAD_LENGTH_INDEX];
-	if (data.size() < RESPONSE_HEADER_LENGTH + dataLength) {
+	size_t dataLength = findPayloadLength(data, findResponseType(data[0], data[1]));
+	if (length < RESPONSE_HEADER_LENGTH + dataLength) {
 		return false;
 	}
 
@@ -276,6 +301,12 @@ std::ostream &operator<<(std::ostream &os, InformationCode code) {
 	case InformationCode::DATA:
 		os << "DATA";
 		break;
+	case InformationCode::DIAGNOSTICS:
+		os << "DIAGNOSTICS";
+		break;
+	case InformationCode::CONFIGURATION_BLOCK:
+		os << "CONFIGURATION_BLOCK";
+		break;
 	default:
 		os << "INVALID";
 		break;
@@ -283,6 +314,85 @@ std::ostream &operator<<(std::ostream &os, InformationCode code) {
 	return os;
 }
 
+View::View(const Message &message) {
+	const ByteArrayBuffer &packet = message.getPacket();
+	size_t start = message.getPayloadStart();
+
+	// The payload length counts the checksum, unless the packet was cut short
+	size_t end = message.getTotalLength();
+	if (end > packet.size()) {
+		end = packet.size();
+	} else if (end > start) {
+		end--;
+	}
+
+	data = end > start ? &packet[start] : 0;
+	length = end > start ? end - start : 0;
+}
+
+size_t BluetoothInfoView::getNameLength() const {
+	size_t i = 0;
+	while (i < NAME_LENGTH && i < length && data[i] != 0) {
+		i++;
+	}
+	return i;
+}
+
+size_t DiagnosticsView::getTextLength() const {
+	size_t i = 0;
+	while (i < length && data[i] != 0) {
+		i++;
+	}
+	return i;
+}
+
+bool DiagnosticsView::getLine(size_t &offset, const char *&line, size_t &lineLength) const {
+	const char *text = getText();
+	size_t end = getTextLength();
+
+	while (offset < end && (text[offset] == '\r' || text[offset] == '\n')) {
+		offset++;
+	}
+	if (offset == end) {
+		return false;
+	}
+
+	line = text + offset;
+	while (offset < end && text[offset] != '\r' && text[offset] != '\n') {
+		offset++;
+	}
+	lineLength = text + offset - line;
+	return true;
+}
+
+bool DiagnosticsView::findValue(const char *name, const char *&value,
+		size_t &valueLength) const {
+	size_t nameLength = strlen(name);
+	size_t offset = 0;
+	const char *line;
+	size_t lineLength;
+
+	while (getLine(offset, line, lineLength)) {
+		if (lineLength <= nameLength || strncmp(line, name, nameLength) != 0
+				|| line[nameLength] != ':') {
+			continue;
+		}
+
+		size_t start = nameLength + 1;
+		size_t end = lineLength;
+		while (start < end && line[start] == ' ') {
+			start++;
+		}
+		while (end > start && line[end - 1] == ' ') {
+			end--;
+		}
+		value = line + start;
+		valueLength = end - start;
+		return true;
+	}
+	return false;
+}
+
 }
 
 }
@@ -20,18 +20,57 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
 #include <iostream>
+#include <algorithm>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/rfcomm.h>
 #include "libSphero.h"
+#include "Tracing.h"
 
 namespace LibSphero {
 
+/* Bytes requested from the socket with every read */
+static const size_t READ_SIZE = 4096;
+
+/* Kernel timestamps older than this are taken for a change of the wall clock */
+static const int64_t MAX_TIMESTAMP_AGE = 1000000000;
+
+/* Returns when the data of a read arrived at the socket. The kernel stamps
+ * the data with the wall clock, so only its age is carried over to the
+ * monotonic clock. Without a timestamp, the data is stamped when read. */
+static std::chrono::steady_clock::time_point getReceiveTime(struct msghdr &msg) {
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPNS) {
+			continue;
+		}
+
+		struct timespec stamp, wall;
+		memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+		clock_gettime(CLOCK_REALTIME, &wall);
+
+		int64_t age = (int64_t)(wall.tv_sec - stamp.tv_sec) * 1000000000
+				+ (wall.tv_nsec - stamp.tv_nsec);
+		if (age >= 0 && age < MAX_TIMESTAMP_AGE) {
+			return now - std::chrono::nanoseconds(age);
+		}
+	}
+	return now;
+}
+
 Robot::Robot() {
 	socket = -1;
+	wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	stopRequested = false;
 	seqNum = 0;
 	state.heading = 0;
 	state.velocity = 0;
@@ -41,86 +80,635 @@ Robot::Robot() {
 	state.blue = 0;
 	state.brightness = 255;
 	state.stop = true;
+	state.stabilization = true;
+	state.streamingDivisor = 0;
+	state.streamingFrames = 0;
+	state.streamingMask = Macro::OFF;
+	state.streamingCount = 0;
 	debug = false;
+	connectionWanted = false;
+	connectionListener = 0;
+	simulation = 0;
+	fleet = 0;
+	fleetIndex = 0;
+	lastResponse = 0;
+	txOffset = 0;
+	txQueued = 0;
+	txDropped = 0;
+	for (std::atomic<Command::MessageType> &request : requests) {
+		request = Command::MessageType::INVALID;
+	}
 }
 
 Robot::~Robot() {
-	// TODO Auto-generated destructor stub
+	if (fleet) {
+		fleet->remove(*this);
+	}
+	disconnect();
+	close(wakeup);
+}
+
+bool Robot::connect(const std::string &_address, unsigned int timeout) {
+	int fd = openSocket(_address);
+	if (fd == -1) {
+		return false;
+	}
+
+	connectionWanted = waitConnect(fd, timeout) && finishConnect(fd, false);
+	return connectionWanted;
+}
+
+bool Robot::connectSocket(int fd, const std::string &name) {
+	if (simulation) {
+		simulation->detach(*this);
+	}
+	if (socket != -1) {
+		close(socket);
+		socket = -1;
+	}
+	address = name;
+
+	// Such a connection cannot be opened again by reconnecting
+	connectionWanted = false;
+	return finishConnect(fd, false);
 }
 
-bool Robot::connect(const std::string &_address) {
-	socket = ::socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+bool Robot::waitConnect(int fd, unsigned int timeout) {
+	struct pollfd pfd = { fd, POLLOUT, 0 };
+	int ready;
+	do {
+		ready = ::poll(&pfd, 1, timeout == 0 ? -1 : (int)timeout);
+	} while (ready == -1 && errno == EINTR);
+
+	if (ready != 1) {
+		if (debug) {
+			std::cout << "Robot: Connection to '" << address << "' timed out!"
+					<< std::endl;
+		}
+		close(fd);
+		return false;
+	}
+
+	return true;
+}
 
+int Robot::openSocket(const std::string &_address) {
+	if (simulation) {
+		simulation->detach(*this);
+	}
+	if (socket != -1) {
+		close(socket);
+		socket = -1;
+		storeInFleet();
+	}
 	address = _address;
 
+	int fd = ::socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+	if (fd == -1) {
+		std::cout << "Robot: Failed to create socket!" << std::endl;
+		return -1;
+	}
+
+	// The connection is started non-blocking so it can be timed out
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
 	struct sockaddr_rc addr = { 0 };
 	addr.rc_family = AF_BLUETOOTH;
 	addr.rc_channel = (uint8_t) 1;
 	str2ba(address.c_str(), &addr.rc_bdaddr);
 
-	if (::connect(socket, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+	if (::connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+			&& errno != EINPROGRESS) {
 		if (debug) {
 			std::cout << "Robot: Failed to connect to address '" << address << "'!"
 					<< std::endl;
 		}
-		close(socket);
-		socket = -1;
-	} else {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+bool Robot::finishConnect(int fd, bool restore) {
+	int error = 0;
+	socklen_t length = sizeof(error);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0) {
 		if (debug) {
-			std::cout << "Robot: Connection to '" << address << "' succeeded!"
+			std::cout << "Robot: Failed to connect to address '" << address << "'!"
 					<< std::endl;
 		}
+		close(fd);
+		return false;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+	// Sockets that cannot stamp the data leave it to process()
+	int enable = 1;
+	setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable));
+	socket = fd;
+	rxBuffer.clear();
+	storeInFleet();
+
+	// Commands meant for an earlier connection are neither written nor retransmitted
+	{
+		std::lock_guard<std::mutex> lock(sendMutex);
+		txQueue.clear();
+		txOffset = 0;
+		txQueued = 0;
+	}
+	{
+		std::lock_guard<std::mutex> lock(retryMutex);
+		unacknowledged.clear();
+	}
+
+	// Wakeups meant for an earlier connection are dropped
+	uint64_t count;
+	while (read(wakeup, &count, sizeof(count)) > 0) {
+	}
+	stopRequested = false;
 
-		send(Macro::abort());
+	if (debug) {
+		std::cout << "Robot: Connection to '" << address << "' succeeded!"
+				<< std::endl;
+	}
+
+	if (restore) {
+		restoreState();
+	} else {
+		sendReliable(Macro::abort());
 		stop();
 	}
 
-	return isConnected();
+	return true;
+}
+
+bool Robot::reconnect() {
+	if (connectionListener) {
+		connectionListener->onDisconnected(*this);
+	}
+
+	unsigned int wait = reconnectPolicy.initialDelay;
+
+	for (unsigned int attempt = 1; reconnectPolicy.attempts == 0
+			|| attempt <= reconnectPolicy.attempts; attempt++) {
+		if (!connectionWanted) {
+			return false;
+		}
+
+		if (connectionListener) {
+			connectionListener->onConnecting(*this, attempt);
+		}
+
+		int fd = openSocket(address);
+		if (fd != -1 && waitConnect(fd, reconnectPolicy.timeout)
+				&& finishConnect(fd, true)) {
+			if (connectionListener) {
+				connectionListener->onReconnected(*this);
+			}
+			return true;
+		}
+
+		delay(wait);
+		wait = std::min(wait * 2, reconnectPolicy.maxDelay);
+	}
+
+	if (connectionListener) {
+		connectionListener->onConnectFailed(*this);
+	}
+	return false;
+}
+
+void Robot::restoreState() {
+	RobotState saved = state;
+
+	sendReliable(Macro::abort());
+	send(Macro::RGBLED(saved.red, saved.green, saved.blue));
+	send(Macro::setFrontLED(saved.brightness));
+	send(Macro::enableStabilizer(saved.stabilization));
+	if (saved.rotationRate != 0) {
+		send(Macro::rotationRate(saved.rotationRate));
+	}
+	send(Macro::roll(saved.heading, saved.stop ? 0 : saved.velocity, saved.stop));
+
+	// Streams limited to a number of packets are considered finished
+	if (saved.streamingMask != Macro::OFF && saved.streamingCount == 0) {
+		send(Macro::setDataStreaming(saved.streamingDivisor,
+				saved.streamingFrames,
+				saved.streamingMask,
+				saved.streamingCount));
+	}
 }
 
 void Robot::setDebug(bool b) {
 	debug = b;
 }
 
+void Robot::setReconnectPolicy(const ReconnectPolicy &policy) {
+	reconnectPolicy = policy;
+}
+
+void Robot::setConnectionListener(IConnectionListener *listener) {
+	connectionListener = listener;
+}
+
 void Robot::disconnect() {
-	if (isConnected()) {
-		close(socket);
-		socket = -1;
+	connectionWanted = false;
+	if (simulation) {
+		simulation->detach(*this);
+	} else if (isConnected()) {
+		// Wakes up a sender blocked in a write, which holds the send mutex
+		shutdown(socket, SHUT_RDWR);
+		{
+			std::lock_guard<std::mutex> lock(sendMutex);
+			if (socket != -1) {
+				close(socket);
+				socket = -1;
+			}
+
+			// Queued packets were meant for this connection
+			txQueue.clear();
+			txOffset = 0;
+			txQueued = 0;
+		}
+		storeInFleet();
+
+		// Wakes up a listen() waiting on the closed socket
+		stopListening();
+	}
+}
+
+int Robot::send(const Command::Message &message) {
+	return send(message, reserveSequenceNumber());
+}
+
+int Robot::send(const Command::Message &message, int sequenceNumber) {
+	std::lock_guard<std::mutex> lock(sendMutex);
+	supersede(message.getCommand());
+	return transmit(message, sequenceNumber);
+}
+
+int Robot::reserveSequenceNumber() {
+	return (uint8_t) seqNum++;
+}
+
+void Robot::setSendQueue(const SendQueueOptions &options) {
+	std::lock_guard<std::mutex> lock(sendMutex);
+	sendQueue = options;
+	sendQueue.capacity = std::max<size_t>(sendQueue.capacity, 1);
+
+	// Later packets are written directly, so they must not overtake the queue
+	while (!sendQueue.enabled && !txQueue.empty() && socket != -1) {
+		struct pollfd pfd = { socket, POLLOUT, 0 };
+		if ((::poll(&pfd, 1, -1) == -1 && errno != EINTR) || !flushQueue()) {
+			break;
+		}
 	}
 }
 
-void Robot::send(const Command::Message &message) {
+bool Robot::flush(int timeout) {
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()
+			+ std::chrono::milliseconds(timeout);
+
+	std::lock_guard<std::mutex> lock(sendMutex);
+	while (flushQueue() && !txQueue.empty()) {
+		int remaining = -1;
+		if (timeout >= 0) {
+			remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+					deadline - std::chrono::steady_clock::now()).count();
+			if (remaining <= 0) {
+				return false;
+			}
+		}
+
+		struct pollfd pfd = { socket, POLLOUT, 0 };
+		if (::poll(&pfd, 1, remaining) == -1 && errno != EINTR) {
+			std::cout << "Robot: Failed to poll!" << std::endl;
+			return false;
+		}
+	}
+	return txQueue.empty();
+}
+
+int Robot::sendReliable(const Command::Message &message, const RetryPolicy &policy) {
+	std::lock_guard<std::mutex> lock(sendMutex);
+	supersede(message.getCommand());
+
+	// Recorded first, as the acknowledgement may arrive before transmit returns
+	int sequenceNumber = reserveSequenceNumber();
+	track(message, policy, sequenceNumber);
+	if (transmit(message, sequenceNumber) == -1) {
+		std::lock_guard<std::mutex> retryLock(retryMutex);
+		unacknowledged.pop_back();
+		return -1;
+	}
+	return sequenceNumber;
+}
+
+void Robot::track(const Command::Message &message, const RetryPolicy &policy,
+		int sequenceNumber) {
+	std::chrono::steady_clock::time_point deadline = getTime()
+			+ std::chrono::milliseconds(policy.timeout);
+	{
+		std::lock_guard<std::mutex> lock(retryMutex);
+		Unacknowledged command = { message, policy, std::vector<int>(1, sequenceNumber), 0,
+				policy.timeout, deadline };
+		unacknowledged.push_back(command);
+	}
+
+	// Emulated robots are not listened to, so the simulation checks instead
+	if (simulation) {
+		simulation->retryAt(*this, deadline);
+	}
+
+	// A listener waiting for data has to wait for the deadline instead
+	wake();
+}
+
+size_t Robot::getUnacknowledged() {
+	std::lock_guard<std::mutex> lock(retryMutex);
+	return unacknowledged.size();
+}
+
+int Robot::transmit(const Command::Message &message, int sequenceNumber, bool block) {
+	// Refused before the packet changes the stored state
+	if (!simulation && !reserve(block)) {
+		return -1;
+	}
+
 	ByteArrayBuffer packet;
-	message.packetize(packet, seqNum++);
+	message.packetize(packet, sequenceNumber);
 
-	updateInternalValues(message);
+	updateInternalValues(message.getCommand(), message.getPayloadPointer());
+	requests[sequenceNumber] = message.getCommand();
+	SPHERO_PROBE3(send, (int) message.getCommand(), sequenceNumber, packet.size());
 
 	if (debug) {
 		std::cout << ">> " << message.getCommand() << ": " << packet << std::endl;
 	}
 
+	if (simulation) {
+		simulation->transmit(*this, &packet[0], packet.size());
+		return sequenceNumber;
+	}
+
+	writePacket(&packet[0], packet.size());
+	return sequenceNumber;
+}
+
+bool Robot::reserve(bool block) {
+	while (sendQueue.enabled && txQueue.size() - (txOffset != 0) >= sendQueue.capacity) {
+		if (!flushQueue()) {
+			return true;
+		} else if (txQueue.size() - (txOffset != 0) < sendQueue.capacity) {
+			break;
+		}
+
+		if (sendQueue.overflow == OverflowPolicy::REJECT
+				|| (sendQueue.overflow == OverflowPolicy::BLOCK && !block)) {
+			return false;
+		} else if (sendQueue.overflow == OverflowPolicy::DROP_OLDEST) {
+			// A partly written packet is finished, or the robot would lose the frame
+			txQueue.erase(txQueue.begin() + (txOffset != 0));
+			txQueued = txQueue.size();
+			txDropped++;
+		} else {
+			struct pollfd pfd = { socket, POLLOUT, 0 };
+			if (::poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+				std::cout << "Robot: Failed to poll!" << std::endl;
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+bool Robot::writePacket(const uint8_t *bytes, size_t length) {
 	size_t offset = 0;
-	const uint8_t* bytes = &packet[0];
 
-	while (offset != packet.size()) {
-		int written = write(socket, bytes + offset, packet.size() - offset);
+	// A packet is cut short only when the connection is lost anyway
+	if (!sendQueue.enabled) {
+		// The rest of a packet left by a timed out broadcast goes first
+		while (!txQueue.empty()) {
+			if (!flushQueue()) {
+				return false;
+			} else if (txQueue.empty()) {
+				break;
+			}
+
+			struct pollfd pfd = { socket, POLLOUT, 0 };
+			if (::poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+				std::cout << "Robot: Failed to poll!" << std::endl;
+				return false;
+			}
+		}
+
+		while (offset != length) {
+			ssize_t written = ::send(socket, bytes + offset, length - offset, MSG_NOSIGNAL);
+			if (written == -1 && errno != EINTR) {
+				std::cout << "Robot: Failed to write!" << std::endl;
+				return false;
+			} else if (written > 0) {
+				offset += written;
+			}
+		}
+		return true;
+	}
+
+	// Later packets wait for the queue, so they cannot overtake it
+	if (!flushQueue()) {
+		return false;
+	}
+	while (txQueue.empty() && offset != length) {
+		ssize_t written = ::send(socket, bytes + offset, length - offset,
+				MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (written == -1 && errno != EINTR) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			std::cout << "Robot: Failed to write!" << std::endl;
+			return false;
+		} else if (written > 0) {
+			offset += written;
+		}
+	}
+
+	if (offset != length) {
+		if (txQueue.empty()) {
+			txOffset = offset;
+		}
+		txQueue.push_back(ByteArrayBuffer(bytes, bytes + length));
+		txQueued = txQueue.size();
+
+		// The listener waits for the link to drain from now on
+		wake();
+	}
+	return true;
+}
+
+bool Robot::flushQueue() {
+	while (!txQueue.empty()) {
+		const ByteArrayBuffer &packet = txQueue.front();
+		ssize_t written = ::send(socket, &packet[txOffset], packet.size() - txOffset,
+				MSG_DONTWAIT | MSG_NOSIGNAL);
 		if (written == -1) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return true;
+			}
 			std::cout << "Robot: Failed to write!" << std::endl;
-			break;
+			txQueue.clear();
+			txOffset = 0;
+			txQueued = 0;
+			return false;
+		}
+
+		txOffset += written;
+		if (txOffset == packet.size()) {
+			txQueue.pop_front();
+			txOffset = 0;
+			txQueued = txQueue.size();
+		}
+	}
+	return true;
+}
+
+void Robot::supersede(Command::MessageType command) {
+	std::lock_guard<std::mutex> lock(retryMutex);
+	for (size_t i = 0; i < unacknowledged.size(); ) {
+		if (unacknowledged[i].message.getCommand() == command) {
+			unacknowledged.erase(unacknowledged.begin() + i);
 		} else {
-			offset += written;
+			i++;
 		}
 	}
 }
 
-void Robot::updateInternalValues(const Command::Message &message) {
-	const ByteArrayBuffer &values = message.getPayload();
+int Robot::getRetryTimeout(int timeout) {
+	std::lock_guard<std::mutex> lock(retryMutex);
+	if (unacknowledged.empty()) {
+		return timeout;
+	}
+
+	std::chrono::steady_clock::time_point deadline = unacknowledged.front().deadline;
+	for (const Unacknowledged &command : unacknowledged) {
+		deadline = std::min(deadline, command.deadline);
+	}
+
+	// Rounded up, so the deadline has passed when poll returns
+	std::chrono::steady_clock::duration left = deadline - std::chrono::steady_clock::now();
+	int milliseconds = left.count() <= 0 ? 0 :
+			std::chrono::duration_cast<std::chrono::milliseconds>(left).count() + 1;
+	return timeout < 0 ? milliseconds : std::min(timeout, milliseconds);
+}
+
+void Robot::acknowledge(IListener &listener, const Response::Message &message) {
+	std::vector<Command::Message> failed;
+	{
+		std::lock_guard<std::mutex> lock(retryMutex);
+		for (size_t i = 0; i < unacknowledged.size(); i++) {
+			Unacknowledged &command = unacknowledged[i];
+			if (std::find(command.seqNums.begin(), command.seqNums.end(),
+					message.getSequenceNumber()) == command.seqNums.end()) {
+				continue;
+			}
+
+			switch (message.getResponseCode()) {
+			case Response::Code::ERROR_CHECKSUM:
+			case Response::Code::ERROR_FRAGMENT:
+			case Response::Code::ERROR_TIME_OUT:
+				// Damaged on the way, so it is sent again at once
+				command.deadline = message.getTimestamp();
+				break;
+			case Response::Code::OK:
+				unacknowledged.erase(unacknowledged.begin() + i);
+				break;
+			default:
+				failed.push_back(command.message);
+				unacknowledged.erase(unacknowledged.begin() + i);
+				break;
+			}
+			break;
+		}
+	}
+	notifyFailed(listener, failed);
+}
 
-	switch (message.getCommand()) {
+void Robot::retransmit(IListener &listener) {
+	// A sender blocked in write waits for this thread to read, so the
+	// retransmission is put off until the next wakeup instead
+	std::unique_lock<std::mutex> sendLock(sendMutex, std::try_to_lock);
+	if (!sendLock.owns_lock()) {
+		return;
+	}
+
+	std::vector<Command::Message> failed;
+	{
+		std::lock_guard<std::mutex> lock(retryMutex);
+		std::chrono::steady_clock::time_point now = getTime();
+
+		for (size_t i = 0; i < unacknowledged.size(); ) {
+			Unacknowledged &command = unacknowledged[i];
+			if (command.deadline > now) {
+				i++;
+			} else if (command.attempts >= command.policy.attempts) {
+				failed.push_back(command.message);
+				unacknowledged.erase(unacknowledged.begin() + i);
+			} else {
+				command.attempts++;
+				command.timeout = std::min(command.timeout * 2, command.policy.maxTimeout);
+				command.deadline = now + std::chrono::milliseconds(command.timeout);
+				command.seqNums.push_back(reserveSequenceNumber());
+				if (transmit(command.message, command.seqNums.back(), false) == -1) {
+					command.seqNums.pop_back();
+				}
+				if (simulation) {
+					simulation->retryAt(*this, command.deadline);
+				}
+				i++;
+			}
+		}
+	}
+	sendLock.unlock();
+	notifyFailed(listener, failed);
+}
+
+std::chrono::steady_clock::time_point Robot::getTime() const {
+	return simulation ? simulation->now() : std::chrono::steady_clock::now();
+}
+
+void Robot::notifyFailed(IListener &listener, const std::vector<Command::Message> &failed) {
+	if (failed.empty()) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(listenerMutex);
+	for (const Command::Message &message : failed) {
+		if (debug) {
+			std::cout << "Robot: Gave up " << message.getCommand() << "!" << std::endl;
+		}
+		for (IListener *extra : listeners) {
+			extra->onCommandFailed(message);
+		}
+		listener.onCommandFailed(message);
+	}
+}
+
+RobotState Robot::copyState() const {
+	std::lock_guard<std::mutex> lock(stateMutex);
+	return state;
+}
+
+void Robot::updateInternalValues(Command::MessageType command, const uint8_t *values) {
+	std::lock_guard<std::mutex> lock(stateMutex);
+	switch (command) {
 	case Command::MessageType::ROLL:
 		state.velocity = values[0];
 		state.heading = (values[1] << 8) + values[2];
-		state.stop = values[3];
+		state.stop = values[3] == 0;
 		break;
 	case Command::MessageType::SPIN_LEFT:
 		// TODO
@@ -142,64 +730,259 @@ void Robot::updateInternalValues(const Command::Message &message) {
 	case Command::MessageType::FRONT_LED_OUTPUT:
 		state.brightness = values[0];
 		break;
+	case Command::MessageType::STABILIZATION:
+		state.stabilization = values[0];
+		break;
+	case Command::MessageType::SET_DATA_STREAMING:
+		state.streamingDivisor = (values[0] << 8) + values[1];
+		state.streamingFrames = (values[2] << 8) + values[3];
+		state.streamingMask = (values[4] << 24) + (values[5] << 16)
+				+ (values[6] << 8) + values[7];
+		state.streamingCount = values[8];
+		break;
 	default:
 		break;
 	}
+
+	if (fleet) {
+		fleet->store(fleetIndex);
+	}
+}
+
+void Robot::storeInFleet() {
+	std::lock_guard<std::mutex> lock(stateMutex);
+	if (fleet) {
+		fleet->store(fleetIndex);
+	}
 }
 
 void Robot::listen(IListener &listener) {
-	uint8_t data[100];
-
-	while(true) {
-		int read = ::read(socket, data, 100);
-		if (read == -1) {
-			if (isConnected()) {
-				std::cout << "Robot: Failed to read!" << std::endl;
-				disconnect();
+	while (process(listener, -1) != -1 && !stopRequested) {
+	}
+	stopRequested = false;
+}
+
+void Robot::stopListening() {
+	stopRequested = true;
+	wake();
+}
+
+void Robot::wake() {
+	uint64_t one = 1;
+	if (write(wakeup, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+		std::cout << "Robot: Failed to signal!" << std::endl;
+	}
+}
+
+int Robot::process(IListener &listener, int timeout) {
+	// Emulated robots are driven by their simulation instead
+	if (socket == -1) {
+		return -1;
+	}
+
+	short events = POLLIN | (txQueued != 0 ? POLLOUT : 0);
+	struct pollfd pfds[2] = { { socket, events, 0 }, { wakeup, POLLIN, 0 } };
+	int ready = ::poll(pfds, 2, getRetryTimeout(timeout));
+	if (ready == -1 && errno != EINTR) {
+		std::cout << "Robot: Failed to poll!" << std::endl;
+		return recover() ? 0 : -1;
+	}
+
+	retransmit(listener);
+
+	// A sender holding the lock writes the queue itself
+	if (pfds[0].revents & POLLOUT) {
+		std::unique_lock<std::mutex> sendLock(sendMutex, std::try_to_lock);
+		if (sendLock.owns_lock()) {
+			flushQueue();
+		}
+	}
+
+	if (pfds[1].revents & POLLIN) {
+		uint64_t count;
+		while (read(wakeup, &count, sizeof(count)) > 0) {
+		}
+	}
+
+	if (socket == -1) {
+		return -1;
+	}
+	if ((pfds[0].revents & ~POLLOUT) == 0) {
+		return 0;
+	}
+
+	// Reads straight into the buffer, as much as is available
+	size_t used = rxBuffer.size();
+	rxBuffer.resize(used + READ_SIZE);
+
+	struct iovec iov = { &rxBuffer[used], READ_SIZE };
+	char control[CMSG_SPACE(sizeof(struct timespec))];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	int read = recvmsg(socket, &msg, 0);
+	if (read <= 0) {
+		rxBuffer.resize(used);
+		if (read == -1 && (errno == EAGAIN || errno == EINTR)) {
+			return 0;
+		}
+		return recover() ? 0 : -1;
+	}
+	rxBuffer.resize(used + read);
+	SPHERO_PROBE2(read, socket, read);
+
+	std::chrono::steady_clock::time_point received = getReceiveTime(msg);
+
+	// Consumed bytes are dropped once all complete packets are handled
+	int packets = 0;
+	size_t offset = 0;
+	while (Response::Message::containsValidPacket(&rxBuffer[offset],
+			rxBuffer.size() - offset)) {
+		Response::Message message(&rxBuffer[offset], rxBuffer.size() - offset);
+		message.setTimestamp(received);
+		SPHERO_PROBE3(parse, (int) message.getResponseType(),
+				message.getSequenceNumber(), message.getTotalLength());
+		if (SPHERO_PROBE_ENABLED(checksum_failure) && message.isCorrupt()) {
+			SPHERO_PROBE3(checksum_failure, message.getSequenceNumber(),
+					message.getClaimedChecksum(), message.getActualChecksum());
+		}
+
+		dispatch(listener, message);
+		packets++;
+
+		offset += message.getTotalLength();
+	}
+	rxBuffer.erase(rxBuffer.begin(), rxBuffer.begin() + offset);
+
+	return packets;
+}
+
+bool Robot::recover() {
+	{
+		// A socket shut down by disconnect() is closed there instead
+		std::lock_guard<std::mutex> lock(sendMutex);
+		if (socket == -1 || !connectionWanted) {
+			return false;
+		}
+
+		std::cout << "Robot: Failed to read!" << std::endl;
+		close(socket);
+		socket = -1;
+	}
+	rxBuffer.clear();
+	storeInFleet();
+
+	if (reconnectPolicy.enabled && connectionWanted && reconnect()) {
+		return true;
+	}
+	connectionWanted = false;
+	return false;
+}
+
+void Robot::dispatch(IListener &listener, Response::Message &message) {
+	if (message.getResponseType() == Response::Type::REGULAR) {
+		message.setCommand(requests[(uint8_t) message.getSequenceNumber()]);
+	}
+
+	if (debug) {
+		switch(message.getResponseType()) {
+		case Response::Type::REGULAR:
+			std::cout << "<< " << message.getResponseType() << "/"
+					<< message.getResponseCode() << ": "
+					<< message.getPacket() << std::endl;
+			break;
+		case Response::Type::INFORMATION:
+			std::cout << "<< " << message.getResponseType() << "/"
+					<< message.getInformationCode() << ": "
+					<< message.getPacket() << std::endl;
+			break;
+		default:
+			std::cout << "<< UNKNOWN: "
+					<< message.getPacket() << std::endl;
+			break;
+		}
+	}
+
+	if (message.getResponseType() == Response::Type::REGULAR) {
+		lastResponse = message.getTimestamp().time_since_epoch().count();
+		if (fleet) {
+			fleet->lastResponses[fleetIndex] = lastResponse;
+		}
+		acknowledge(listener, message);
+	}
+
+	std::lock_guard<std::mutex> lock(listenerMutex);
+	SPHERO_PROBE2(dispatch_entry, (int) message.getResponseType(),
+			message.getSequenceNumber());
+
+	for (IListener *extra : listeners) {
+		extra->onPacketReceived(message);
+	}
+	listener.onPacketReceived(message);
+
+	if (message.getInformationCode() == Response::InformationCode::DATA
+			&& sensorData.decode(message, state.streamingMask,
+					state.streamingDivisor)) {
+		for (IListener *extra : listeners) {
+			extra->onSensorData(sensorData);
+		}
+		listener.onSensorData(sensorData);
+	}
+
+	if (message.getResponseType() == Response::Type::REGULAR
+			&& message.getResponseCode() == Response::Code::OK) {
+		if (message.getCommand() == Command::MessageType::VERSIONING) {
+			Response::VersionView version(message);
+			if (version.isValid()) {
+				for (IListener *extra : listeners) {
+					extra->onVersion(version);
+				}
+				listener.onVersion(version);
 			}
-			return;
-		}
-		for (int k = 0; k < read; k++) {
-			rxBuffer.push_back(data[k]);
-		}
-
-		while (Response::Message::containsValidPacket(rxBuffer)) {
-			Response::Message message(rxBuffer);
-
-			if (debug) {
-				switch(message.getResponseType()) {
-				case Response::Type::REGULAR:
-					std::cout << "<< " << message.getResponseType() << "/"
-							<< message.getResponseCode() << ": "
-							<< message.getPacket() << std::endl;
-					break;
-				case Response::Type::INFORMATION:
-					std::cout << "<< " << message.getResponseType() << "/"
-							<< message.getInformationCode() << ": "
-							<< message.getPacket() << std::endl;
-					break;
-				default:
-					std::cout << "<< UNKNOWN: "
-							<< message.getPacket() << std::endl;
-					break;
+		} else if (message.getCommand() == Command::MessageType::GET_BLUETOOTH_INFO) {
+			Response::BluetoothInfoView info(message);
+			if (info.isValid()) {
+				for (IListener *extra : listeners) {
+					extra->onBluetoothInfo(info);
 				}
+				listener.onBluetoothInfo(info);
 			}
+		}
+	} else if (message.getInformationCode() == Response::InformationCode::CONFIGURATION_BLOCK) {
+		Response::ConfigurationBlockView block(message);
+		for (IListener *extra : listeners) {
+			extra->onConfigurationBlock(block);
+		}
+		listener.onConfigurationBlock(block);
+	} else if (message.getInformationCode() == Response::InformationCode::DIAGNOSTICS) {
+		Response::DiagnosticsView diagnostics(message);
+		for (IListener *extra : listeners) {
+			extra->onDiagnostics(diagnostics);
+		}
+		listener.onDiagnostics(diagnostics);
+	}
 
-			listener.onPacketReceived(message);
+	SPHERO_PROBE2(dispatch_return, (int) message.getResponseType(),
+			message.getSequenceNumber());
+}
 
-			size_t offset = message.getTotalLength();
-			if (offset != rxBuffer.size()) {
-				std::copy(rxBuffer.begin() + offset,
-						rxBuffer.end(),
-						rxBuffer.begin());
-				rxBuffer.resize(rxBuffer.size() - offset);
-			} else {
-				rxBuffer.clear();
-			}
-		}
+void Robot::addListener(IListener &listener) {
+	std::lock_guard<std::mutex> lock(listenerMutex);
+	if (std::find(listeners.begin(), listeners.end(), &listener) == listeners.end()) {
+		listeners.push_back(&listener);
 	}
 }
 
+void Robot::removeListener(IListener &listener) {
+	std::lock_guard<std::mutex> lock(listenerMutex);
+	listeners.erase(std::remove(listeners.begin(), listeners.end(), &listener),
+			listeners.end());
+}
+
 void Robot::roll(int heading, uint8_t speed) {
 	heading = ((heading % 360) + 360) % 360;
 	send(Macro::roll(heading, speed, false));
@@ -207,7 +990,7 @@ void Robot::roll(int heading, uint8_t speed) {
 
 void Robot::calibrateHeading(int heading) {
 	roll(heading, 0);
-	send(Macro::calibrate(heading));
+	sendReliable(Macro::calibrate(heading));
 }
 
 void Robot::setHeading(int heading) {
@@ -231,10 +1014,15 @@ void Robot::enableStabilizer(bool on) {
 }
 
 void Robot::stop() {
-	send(Macro::roll(state.heading, 0, true));
+	sendReliable(Macro::roll(state.heading, 0, true));
 }
 
 void Robot::delay(unsigned int milliseconds) {
+	if (simulation) {
+		simulation->runFor(std::chrono::milliseconds(milliseconds));
+		return;
+	}
+
 	if (milliseconds > 1000) {
 		int seconds = milliseconds / 1000;
 		sleep(seconds);
@@ -0,0 +1,243 @@
+
+/*
+Copyright (C) 2012 Antonio Zea, akzeac@gmail.com, Karlsruhe Institute of Technology
+This code borrows heavily from code by Nicklas Gavelin, nicklas.gavelin@gmail.com,
+Luleå University of Technology
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "libSphero.h"
+
+namespace LibSphero {
+
+/** Clears the counter of a timerfd or eventfd */
+static void drain(int fd) {
+	uint64_t count;
+	while (read(fd, &count, sizeof(count)) > 0) {
+	}
+}
+
+Scheduler::Scheduler() {
+	// steady_clock is CLOCK_MONOTONIC, so its time points can arm the timer
+	timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	stopRequested = false;
+
+	if (timer == -1 || event == -1) {
+		std::cout << "Scheduler: Failed to create timer!" << std::endl;
+	}
+}
+
+Scheduler::~Scheduler() {
+	if (timer != -1) {
+		close(timer);
+	}
+	if (event != -1) {
+		close(event);
+	}
+}
+
+Scheduler::Entry *Scheduler::findEntry(const IPeriodicTask &task) {
+	for (Entry &entry : entries) {
+		if (entry.task == &task) {
+			return &entry;
+		}
+	}
+	return 0;
+}
+
+void Scheduler::add(IPeriodicTask &task, double rate) {
+	// A period of zero or less would make run() spin
+	if (!(rate > 0) || std::isinf(rate)) {
+		std::cout << "Scheduler: Invalid rate " << rate << "!" << std::endl;
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	Entry entry;
+	entry.task = &task;
+	entry.period = std::chrono::duration_cast<Clock::duration>(
+			std::chrono::duration<double>(1.0 / rate));
+	entry.start = Clock::now();
+	entry.next = entry.start;
+	entry.tick = 0;
+	memset(&entry.statistics, 0, sizeof(entry.statistics));
+
+	Entry *existing = findEntry(task);
+	if (existing) {
+		*existing = entry;
+	} else {
+		entries.push_back(entry);
+	}
+
+	// Wakes up run() so the new deadline is taken into account
+	uint64_t one = 1;
+	if (write(event, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+		std::cout << "Scheduler: Failed to signal!" << std::endl;
+	}
+}
+
+void Scheduler::remove(IPeriodicTask &task) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	for (size_t i = 0; i < entries.size(); i++) {
+		if (entries[i].task == &task) {
+			entries.erase(entries.begin() + i);
+			return;
+		}
+	}
+}
+
+SchedulerStatistics Scheduler::getStatistics(const IPeriodicTask &task) const {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	SchedulerStatistics statistics;
+	memset(&statistics, 0, sizeof(statistics));
+
+	for (const Entry &entry : entries) {
+		if (entry.task == &task) {
+			statistics = entry.statistics;
+		}
+	}
+	return statistics;
+}
+
+void Scheduler::stop() {
+	std::lock_guard<std::mutex> lock(mutex);
+	stopRequested = true;
+
+	uint64_t one = 1;
+	if (write(event, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+		std::cout << "Scheduler: Failed to signal!" << std::endl;
+	}
+}
+
+void Scheduler::run() {
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (!stopRequested) {
+		if (entries.empty()) {
+			lock.unlock();
+			struct pollfd pfd = { event, POLLIN, 0 };
+			poll(&pfd, 1, -1);
+			lock.lock();
+		} else {
+			Clock::time_point nearest = entries[0].next;
+			for (const Entry &entry : entries) {
+				nearest = std::min(nearest, entry.next);
+			}
+
+			std::chrono::nanoseconds since = std::chrono::duration_cast<
+					std::chrono::nanoseconds>(nearest.time_since_epoch());
+
+			struct itimerspec spec;
+			memset(&spec, 0, sizeof(spec));
+			spec.it_value.tv_sec = since.count() / 1000000000;
+			spec.it_value.tv_nsec = since.count() % 1000000000;
+			if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+				spec.it_value.tv_nsec = 1; // zero would disarm the timer
+			}
+			timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, 0);
+
+			lock.unlock();
+			struct pollfd pfds[2] = { { timer, POLLIN, 0 }, { event, POLLIN, 0 } };
+			int ready = poll(pfds, 2, -1);
+			lock.lock();
+
+			if (ready == -1 && errno != EINTR) {
+				std::cout << "Scheduler: Failed to poll!" << std::endl;
+				break;
+			}
+		}
+
+		drain(timer);
+		drain(event);
+
+		// Runs every due task, earliest deadline first
+		while (!stopRequested) {
+			Clock::time_point now = Clock::now();
+			Entry *due = 0;
+			for (Entry &entry : entries) {
+				if (entry.next <= now && (!due || entry.next < due->next)) {
+					due = &entry;
+				}
+			}
+			if (!due) {
+				break;
+			}
+			runEntry(lock, *due, now);
+		}
+	}
+
+	// Cleared only here, so a stop() before run() is not lost
+	stopRequested = false;
+}
+
+void Scheduler::runEntry(std::unique_lock<std::mutex> &lock,
+		Entry &entry, Clock::time_point now) {
+	SchedulerStatistics &statistics = entry.statistics;
+
+	TickInfo info;
+	info.tick = entry.tick++;
+	info.deadline = entry.next;
+	info.lateness = now - entry.next;
+	info.skipped = 0;
+
+	// Deadlines that already passed are skipped, keeping the phase
+	uint64_t periods = (now - entry.start) / entry.period + 1;
+	uint64_t scheduled = (entry.next - entry.start) / entry.period + 1;
+	if (periods > scheduled) {
+		info.skipped = periods - scheduled;
+		statistics.skipped += info.skipped;
+	}
+	entry.next = entry.start + entry.period * periods;
+
+	double lateness = std::chrono::duration<double, std::micro>(info.lateness).count();
+	int bucket = 0;
+	while (bucket < SchedulerStatistics::HISTOGRAM_SIZE - 1
+			&& lateness >= (2 << bucket)) {
+		bucket++;
+	}
+	statistics.lateness[bucket]++;
+	statistics.maxLateness = std::max(statistics.maxLateness, lateness);
+	statistics.runs++;
+
+	IPeriodicTask *task = entry.task;
+	Clock::time_point next = entry.next;
+
+	lock.unlock();
+	task->onTick(info);
+	lock.lock();
+
+	if (Clock::now() > next) {
+		Entry *current = findEntry(*task);
+		if (current) {
+			current->statistics.overruns++;
+		}
+	}
+}
+
+}
@@ -0,0 +1,97 @@
+
+/*
+Copyright (C) 2012 Antonio Zea, akzeac@gmail.com, Karlsruhe Institute of Technology
+This code borrows heavily from code by Nicklas Gavelin, nicklas.gavelin@gmail.com,
+Luleå University of Technology
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <algorithm>
+#include "libSphero.h"
+
+namespace LibSphero {
+
+SensorData::SensorData() {
+	mask = Macro::OFF;
+	channels = 0;
+	frames = 0;
+	period = std::chrono::steady_clock::duration::zero();
+}
+
+size_t SensorData::countChannels(int mask) {
+	return __builtin_popcount((unsigned int) mask);
+}
+
+int SensorData::getChannelSensor(int mask, size_t channel) {
+	for (int bit = 31; bit >= 0; bit--) {
+		unsigned int sensor = 1u << bit;
+		if ((mask & sensor) && channel-- == 0) {
+			return (int) sensor;
+		}
+	}
+	return Macro::OFF;
+}
+
+int SensorData::getChannelIndex(int mask, int sensor) {
+	unsigned int bits = (unsigned int) sensor;
+	if (!((unsigned int) mask & bits) || (bits & (bits - 1)) != 0) {
+		return -1;
+	}
+
+	// Channels are ordered from the most significant bit down
+	unsigned int higher = (unsigned int) mask & ~((bits << 1) - 1);
+	return __builtin_popcount(higher);
+}
+
+int SensorData::getChannelIndex(Macro::StreamingMasks sensor) const {
+	return getChannelIndex(mask, sensor);
+}
+
+bool SensorData::decode(const Response::Message &message, int _mask,
+		uint16_t divisor) {
+	size_t count = countChannels(_mask);
+	if (count == 0 || message.getPayloadLength() == 0) {
+		return false;
+	}
+
+	// The payload length includes the checksum
+	size_t length = message.getPayloadLength() - 1;
+	size_t frameLength = count * 2;
+	if (length % frameLength != 0) {
+		return false;
+	}
+
+	mask = _mask;
+	channels = count;
+	frames = length / frameLength;
+	values.resize(channels * frames);
+	timestamp = message.getTimestamp();
+	period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(std::max<int>(divisor, 1) / (double) BASE_RATE));
+
+	// Frames arrive one after the other, and are stored by channel
+	const uint8_t *data = message.getPacketPointer() + message.getPayloadStart();
+	for (size_t frame = 0; frame < frames; frame++) {
+		for (size_t channel = 0; channel < channels; channel++) {
+			const uint8_t *value = data + frame * frameLength + channel * 2;
+			values[channel * frames + frame] = (int16_t) ((value[0] << 8) | value[1]);
+		}
+	}
+
+	return true;
+}
+
+}
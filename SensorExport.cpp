@@ -0,0 +1,258 @@
+
+/*
+Copyright (C) 2012 Antonio Zea, akzeac@gmail.com, Karlsruhe Institute of Technology
+This code borrows heavily from code by Nicklas Gavelin, nicklas.gavelin@gmail.com,
+Luleå University of Technology
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <iostream>
+#include <algorithm>
+#include <limits>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "libSphero.h"
+
+namespace LibSphero {
+
+namespace {
+
+const uint32_t EXPORT_MAGIC = 0x43485053; // "SPHC"
+const uint32_t EXPORT_VERSION = 1;
+const uint32_t CHUNK_MAGIC = 0x4B4E4843; // "CHNK"
+
+/** Start of the file */
+struct FileHeader {
+	uint32_t magic;
+	uint32_t version;
+	int64_t clockOffset;
+};
+
+/** Start of every chunk, followed by the limits, times and values */
+struct ChunkHeader {
+	uint32_t magic;
+	int32_t mask;
+	uint32_t channels;
+	uint32_t frames;
+	uint64_t size;
+};
+
+/** Rounds up to a multiple of 8, so every column stays aligned */
+size_t align(size_t size) {
+	return (size + 7) & ~(size_t) 7;
+}
+
+size_t getLimitsOffset() {
+	return sizeof(ChunkHeader);
+}
+
+size_t getTimesOffset(size_t channels) {
+	return align(getLimitsOffset() + channels * 2 * sizeof(int16_t));
+}
+
+size_t getValuesOffset(size_t channels, size_t frames) {
+	return getTimesOffset(channels) + frames * sizeof(int64_t);
+}
+
+size_t getChunkSize(size_t channels, size_t frames) {
+	return align(getValuesOffset(channels, frames) + channels * frames * sizeof(int16_t));
+}
+
+int64_t getNanoseconds(std::chrono::steady_clock::time_point time) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			time.time_since_epoch()).count();
+}
+
+}
+
+SensorExporter::SensorExporter(const std::string &path, size_t _chunkFrames) :
+	file(0),
+	chunkFrames(std::max<size_t>(_chunkFrames, 1)),
+	mask(Macro::OFF),
+	channels(0),
+	frames(0) {
+	file = fopen(path.c_str(), "wb");
+	if (!file) {
+		std::cout << "SensorExporter: Failed to create '" << path << "'!" << std::endl;
+		return;
+	}
+
+	// Lets readers turn the monotonic times into calendar times
+	int64_t realtime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+	int64_t monotonic = getNanoseconds(std::chrono::steady_clock::now());
+
+	FileHeader header = { EXPORT_MAGIC, EXPORT_VERSION, realtime - monotonic };
+	fwrite(&header, sizeof(header), 1, file);
+	fflush(file);
+}
+
+SensorExporter::~SensorExporter() {
+	if (file) {
+		flush();
+		fclose(file);
+	}
+}
+
+void SensorExporter::onPacketReceived(const Response::Message &) {
+}
+
+void SensorExporter::onSensorData(const SensorData &data) {
+	if (!file) {
+		return;
+	}
+
+	if (data.getMask() != mask) {
+		flush();
+		mask = data.getMask();
+		channels = data.getChannelCount();
+		times.resize(chunkFrames);
+		values.resize(chunkFrames * channels);
+	}
+
+	for (size_t frame = 0; frame < data.getFrameCount(); frame++) {
+		times[frames] = getNanoseconds(data.getSampleTime(frame));
+		for (size_t channel = 0; channel < channels; channel++) {
+			values[channel * chunkFrames + frames] = data.getValue(channel, frame);
+		}
+
+		if (++frames == chunkFrames) {
+			flush();
+		}
+	}
+}
+
+void SensorExporter::flush() {
+	if (!file || frames == 0) {
+		return;
+	}
+
+	chunk.assign(getChunkSize(channels, frames), 0);
+
+	ChunkHeader header = { CHUNK_MAGIC, mask, (uint32_t) channels,
+			(uint32_t) frames, chunk.size() };
+	memcpy(&chunk[0], &header, sizeof(header));
+
+	int16_t *limits = (int16_t *) &chunk[getLimitsOffset()];
+	int16_t *columns = (int16_t *) &chunk[getValuesOffset(channels, frames)];
+	memcpy(&chunk[getTimesOffset(channels)], &times[0], frames * sizeof(int64_t));
+
+	for (size_t channel = 0; channel < channels; channel++) {
+		const int16_t *column = &values[channel * chunkFrames];
+		std::pair<const int16_t*, const int16_t*> range =
+				std::minmax_element(column, column + frames);
+
+		limits[channel * 2] = *range.first;
+		limits[channel * 2 + 1] = *range.second;
+		memcpy(columns + channel * frames, column, frames * sizeof(int16_t));
+	}
+
+	// Written at once, so readers only ever see whole chunks
+	if (fwrite(&chunk[0], chunk.size(), 1, file) != 1) {
+		std::cout << "SensorExporter: Failed to write!" << std::endl;
+	}
+	fflush(file);
+	frames = 0;
+}
+
+SensorArchive::SensorArchive(const std::string &path) :
+	memory(0),
+	size(0),
+	clockOffset(0) {
+	fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		std::cout << "SensorArchive: Failed to open '" << path << "'!" << std::endl;
+		return;
+	}
+
+	refresh();
+
+	if (!memory) {
+		std::cout << "SensorArchive: Invalid file '" << path << "'!" << std::endl;
+	}
+}
+
+SensorArchive::~SensorArchive() {
+	if (memory) {
+		munmap(memory, size);
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+}
+
+size_t SensorArchive::refresh() {
+	struct stat info;
+	if (fd == -1 || fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(FileHeader)) {
+		return chunks.size();
+	}
+
+	if ((size_t) info.st_size != size) {
+		if (memory) {
+			munmap(memory, size);
+			memory = 0;
+		}
+
+		void *mapped = mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (mapped == MAP_FAILED) {
+			size = 0;
+			chunks.clear();
+			return 0;
+		}
+		memory = mapped;
+		size = info.st_size;
+	}
+
+	const uint8_t *bytes = (const uint8_t *) memory;
+	const FileHeader *header = (const FileHeader *) bytes;
+	if (header->magic != EXPORT_MAGIC || header->version != EXPORT_VERSION) {
+		munmap(memory, size);
+		memory = 0;
+		size = 0;
+		return 0;
+	}
+	clockOffset = header->clockOffset;
+
+	// The mapping may have moved, so the chunks are found again
+	chunks.clear();
+	size_t offset = align(sizeof(FileHeader));
+	while (offset + sizeof(ChunkHeader) <= size) {
+		const ChunkHeader *chunkHeader = (const ChunkHeader *) (bytes + offset);
+		if (chunkHeader->magic != CHUNK_MAGIC || chunkHeader->size > size - offset
+				|| chunkHeader->size != getChunkSize(chunkHeader->channels, chunkHeader->frames)) {
+			break;
+		}
+
+		SensorChunk chunk;
+		chunk.mask = chunkHeader->mask;
+		chunk.channels = chunkHeader->channels;
+		chunk.frames = chunkHeader->frames;
+		chunk.limits = (const int16_t *) (bytes + offset + getLimitsOffset());
+		chunk.times = (const int64_t *) (bytes + offset + getTimesOffset(chunk.channels));
+		chunk.values = (const int16_t *) (bytes + offset
+				+ getValuesOffset(chunk.channels, chunk.frames));
+		chunks.push_back(chunk);
+
+		offset += chunkHeader->size;
+	}
+
+	return chunks.size();
+}
+
+}
@@ -0,0 +1,304 @@
+
+/*
+Copyright (C) 2012 Antonio Zea, akzeac@gmail.com, Karlsruhe Institute of Technology
+This code borrows heavily from code by Nicklas Gavelin, nicklas.gavelin@gmail.com,
+Luleå University of Technology
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <algorithm>
+#include <cmath>
+#include "libSphero.h"
+
+namespace LibSphero {
+
+/* Highest cutoff allowed, relative to the sampling rate */
+static const double MAX_CUTOFF = 0.49;
+
+SensorFilter::SensorFilter(IFilterListener &_listener) :
+	listener(_listener) {
+	mask = Macro::OFF;
+	channels = 0;
+	period = Clock::duration::zero();
+}
+
+SensorFilter::~SensorFilter() {
+}
+
+void SensorFilter::addLowPass(double cutoff) {
+	Stage stage = Stage();
+	stage.type = BIQUAD;
+	stage.cutoff = cutoff;
+	stages.push_back(stage);
+	mask = Macro::OFF;
+}
+
+void SensorFilter::addHighPass(double cutoff) {
+	Stage stage = Stage();
+	stage.type = BIQUAD;
+	stage.highPass = true;
+	stage.cutoff = cutoff;
+	stages.push_back(stage);
+	mask = Macro::OFF;
+}
+
+void SensorFilter::addDerivative() {
+	Stage stage = Stage();
+	stage.type = DERIVATIVE;
+	stages.push_back(stage);
+	mask = Macro::OFF;
+}
+
+void SensorFilter::addFIR(const std::vector<float> &taps) {
+	if (taps.empty()) {
+		return;
+	}
+
+	Stage stage = Stage();
+	stage.type = FIR;
+	stage.taps = taps;
+	stages.push_back(stage);
+	mask = Macro::OFF;
+}
+
+void SensorFilter::addDecimation(unsigned int factor) {
+	Stage stage = Stage();
+	stage.type = DECIMATION;
+	stage.factor = std::max(factor, 1u);
+	stages.push_back(stage);
+	mask = Macro::OFF;
+}
+
+void SensorFilter::addThreshold(Macro::StreamingMasks sensor, float level, float hysteresis) {
+	Threshold threshold = { sensor, level, std::max(hysteresis, 0.0f), -1, 0 };
+	thresholds.push_back(threshold);
+	mask = Macro::OFF;
+}
+
+void SensorFilter::reset() {
+	std::fill(state.begin(), state.end(), 0.0f);
+	for (Stage &stage : stages) {
+		stage.position = 0;
+		stage.primed = false;
+	}
+	for (Threshold &threshold : thresholds) {
+		threshold.side = 0;
+	}
+}
+
+void SensorFilter::configure(const SensorData &data) {
+	mask = data.getMask();
+	channels = data.getChannelCount();
+	period = data.getSamplePeriod();
+
+	// Each stage runs at the rate left by the decimations before it
+	double rate = 1 / std::chrono::duration<double>(period).count();
+	size_t size = 0;
+
+	for (Stage &stage : stages) {
+		stage.state = size;
+		switch (stage.type) {
+		case BIQUAD: {
+			double w0 = 2 * M_PI * std::min(stage.cutoff / rate, MAX_CUTOFF);
+			double alpha = sin(w0) / (2 * M_SQRT1_2);
+			double a0 = 1 + alpha;
+			double b1 = stage.highPass ? -(1 + cos(w0)) : 1 - cos(w0);
+
+			stage.coefficients[0] = (float) (fabs(b1) / 2 / a0);
+			stage.coefficients[1] = (float) (b1 / a0);
+			stage.coefficients[2] = stage.coefficients[0];
+			stage.coefficients[3] = (float) (-2 * cos(w0) / a0);
+			stage.coefficients[4] = (float) ((1 - alpha) / a0);
+			size += channels * 2;
+			break;
+		}
+		case DERIVATIVE:
+			stage.coefficients[0] = (float) rate;
+			size += channels;
+			break;
+		case FIR:
+			size += channels * stage.taps.size();
+			break;
+		case DECIMATION:
+			rate /= stage.factor;
+			break;
+		}
+	}
+
+	for (Threshold &threshold : thresholds) {
+		threshold.channel = SensorData::getChannelIndex(mask, threshold.sensor);
+	}
+
+	state.resize(size);
+	reset();
+}
+
+void SensorFilter::process(const SensorData &data) {
+	if (data.getMask() != mask || data.getSamplePeriod() != period) {
+		configure(data);
+	}
+
+	// Frames side by side, so every stage runs over contiguous channels
+	size_t frames = data.getFrameCount();
+	work.resize(frames * channels);
+	times.resize(frames);
+	for (size_t channel = 0; channel < channels; channel++) {
+		const int16_t *values = data.getChannel(channel);
+		for (size_t frame = 0; frame < frames; frame++) {
+			work[frame * channels + channel] = values[frame];
+		}
+	}
+	for (size_t frame = 0; frame < frames; frame++) {
+		times[frame] = data.getSampleTime(frame);
+	}
+
+	for (Stage &stage : stages) {
+		frames = runStage(stage, frames);
+	}
+	if (frames == 0) {
+		return;
+	}
+
+	detectCrossings(frames);
+
+	output.mask = mask;
+	output.channels = channels;
+	output.frames = frames;
+	output.values = &work[0];
+	output.times = &times[0];
+	listener.onFilteredData(output);
+}
+
+size_t SensorFilter::runStage(Stage &stage, size_t frames) {
+	float *values = work.empty() ? 0 : &work[0];
+
+	switch (stage.type) {
+	case BIQUAD: {
+		// Transposed direct form II
+		float *z1 = &state[stage.state];
+		float *z2 = z1 + channels;
+		const float b0 = stage.coefficients[0], b1 = stage.coefficients[1],
+				b2 = stage.coefficients[2], a1 = stage.coefficients[3],
+				a2 = stage.coefficients[4];
+
+		for (size_t frame = 0; frame < frames; frame++) {
+			float *x = values + frame * channels;
+			for (size_t channel = 0; channel < channels; channel++) {
+				float y = b0 * x[channel] + z1[channel];
+				z1[channel] = b1 * x[channel] - a1 * y + z2[channel];
+				z2[channel] = b2 * x[channel] - a2 * y;
+				x[channel] = y;
+			}
+		}
+		return frames;
+	}
+	case DERIVATIVE: {
+		float *previous = &state[stage.state];
+		const float rate = stage.coefficients[0];
+
+		// Without a previous frame, the first one has no change
+		size_t frame = 0;
+		if (!stage.primed && frames > 0) {
+			std::copy(values, values + channels, previous);
+			std::fill(values, values + channels, 0.0f);
+			stage.primed = true;
+			frame = 1;
+		}
+
+		for (; frame < frames; frame++) {
+			float *x = values + frame * channels;
+			for (size_t channel = 0; channel < channels; channel++) {
+				float y = (x[channel] - previous[channel]) * rate;
+				previous[channel] = x[channel];
+				x[channel] = y;
+			}
+		}
+		return frames;
+	}
+	case FIR: {
+		// The history is a ring of frames, the newest at the position
+		const size_t length = stage.taps.size();
+		float *history = &state[stage.state];
+
+		for (size_t frame = 0; frame < frames; frame++) {
+			float *x = values + frame * channels;
+			std::copy(x, x + channels, history + stage.position * channels);
+			std::fill(x, x + channels, 0.0f);
+
+			size_t slot = stage.position;
+			for (size_t tap = 0; tap < length; tap++) {
+				const float weight = stage.taps[tap];
+				const float *past = history + slot * channels;
+				for (size_t channel = 0; channel < channels; channel++) {
+					x[channel] += weight * past[channel];
+				}
+				slot = slot == 0 ? length - 1 : slot - 1;
+			}
+			stage.position = (stage.position + 1) % length;
+		}
+		return frames;
+	}
+	case DECIMATION: {
+		// The phase carries over, so the kept frames stay evenly spaced
+		size_t kept = 0;
+		for (size_t frame = 0; frame < frames; frame++) {
+			if (stage.position == 0) {
+				std::copy(values + frame * channels, values + (frame + 1) * channels,
+						values + kept * channels);
+				times[kept] = times[frame];
+				kept++;
+			}
+			stage.position = (stage.position + 1) % stage.factor;
+		}
+		return kept;
+	}
+	}
+	return frames;
+}
+
+void SensorFilter::detectCrossings(size_t frames) {
+	for (Threshold &threshold : thresholds) {
+		if (threshold.channel == -1) {
+			continue;
+		}
+
+		for (size_t frame = 0; frame < frames; frame++) {
+			float value = work[frame * channels + threshold.channel];
+			int side = threshold.side;
+			if (value >= threshold.level) {
+				side = 1;
+			} else if (value <= threshold.level - threshold.hysteresis) {
+				side = -1;
+			}
+
+			// The first value only tells on which side the channel starts
+			if (side != threshold.side && threshold.side != 0) {
+				ThresholdCrossing crossing = { threshold.sensor, times[frame], value, side == 1 };
+				listener.onThresholdCrossed(crossing);
+			}
+			threshold.side = side;
+		}
+	}
+}
+
+void SensorFilter::onPacketReceived(const Response::Message &) {
+}
+
+void SensorFilter::onSensorData(const SensorData &data) {
+	process(data);
+}
+
+}
@@ -0,0 +1,212 @@
+
+/*
+Copyright (C) 2012 Antonio Zea, akzeac@gmail.com, Karlsruhe Institute of Technology
+This code borrows heavily from code by Nicklas Gavelin, nicklas.gavelin@gmail.com,
+Luleå University of Technology
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <algorithm>
+#include <limits>
+#include "libSphero.h"
+
+namespace LibSphero {
+
+SensorHistory::SensorHistory(size_t _capacity) {
+	capacity = 1;
+	while (capacity < _capacity) {
+		capacity <<= 1;
+	}
+	mask = Macro::OFF;
+	channels = 0;
+	count = 0;
+	times.resize(capacity);
+}
+
+SensorHistory::~SensorHistory() {
+}
+
+void SensorHistory::clear() {
+	std::lock_guard<std::mutex> lock(mutex);
+	count = 0;
+}
+
+size_t SensorHistory::size() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return (size_t) std::min<uint64_t>(count, capacity);
+}
+
+void SensorHistory::onPacketReceived(const Response::Message &) {
+}
+
+void SensorHistory::onSensorData(const SensorData &data) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (data.getMask() != mask) {
+		mask = data.getMask();
+		channels = data.getChannelCount();
+		count = 0;
+
+		Node empty = { std::numeric_limits<int16_t>::max(),
+				std::numeric_limits<int16_t>::min(), 0 };
+		trees.assign(channels * capacity * 2, empty);
+	}
+
+	for (size_t frame = 0; frame < data.getFrameCount(); frame++) {
+		size_t position = count % capacity;
+
+		// Binary searches need the times in order, even if packets jitter
+		Clock::time_point time = data.getSampleTime(frame);
+		if (count > 0) {
+			time = std::max(time, times[(count - 1) % capacity]);
+		}
+		times[position] = time;
+
+		for (size_t channel = 0; channel < channels; channel++) {
+			store(channel, position, data.getValue(channel, frame));
+		}
+		count++;
+	}
+}
+
+void SensorHistory::store(size_t channel, size_t position, int16_t value) {
+	Node *tree = &trees[channel * capacity * 2];
+
+	size_t node = position + capacity;
+	tree[node].min = value;
+	tree[node].max = value;
+	tree[node].sum = value;
+
+	for (node >>= 1; node > 0; node >>= 1) {
+		const Node &left = tree[node * 2];
+		const Node &right = tree[node * 2 + 1];
+		tree[node].min = std::min(left.min, right.min);
+		tree[node].max = std::max(left.max, right.max);
+		tree[node].sum = left.sum + right.sum;
+	}
+}
+
+SensorHistory::Node SensorHistory::query(size_t channel, size_t begin, size_t end) const {
+	const Node *tree = &trees[channel * capacity * 2];
+
+	Node result = { std::numeric_limits<int16_t>::max(),
+			std::numeric_limits<int16_t>::min(), 0 };
+
+	for (begin += capacity, end += capacity; begin < end; begin >>= 1, end >>= 1) {
+		if (begin & 1) {
+			const Node &node = tree[begin++];
+			result.min = std::min(result.min, node.min);
+			result.max = std::max(result.max, node.max);
+			result.sum += node.sum;
+		}
+		if (end & 1) {
+			const Node &node = tree[--end];
+			result.min = std::min(result.min, node.min);
+			result.max = std::max(result.max, node.max);
+			result.sum += node.sum;
+		}
+	}
+
+	return result;
+}
+
+uint64_t SensorHistory::lowerBound(Clock::time_point time) const {
+	uint64_t first = count > capacity ? count - capacity : 0;
+	uint64_t last = count;
+
+	while (first < last) {
+		uint64_t middle = first + (last - first) / 2;
+		if (times[middle % capacity] < time) {
+			first = middle + 1;
+		} else {
+			last = middle;
+		}
+	}
+	return first;
+}
+
+bool SensorHistory::getAggregate(Macro::StreamingMasks sensor,
+		Clock::time_point from, Clock::time_point to,
+		SensorAggregate &aggregate) const {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	int channel = SensorData::getChannelIndex(mask, sensor);
+	if (channel == -1 || count == 0) {
+		return false;
+	}
+
+	uint64_t begin = lowerBound(from);
+	uint64_t end = lowerBound(to);
+	if (begin >= end) {
+		return false;
+	}
+
+	// The span may wrap around the end of the ring
+	size_t first = begin % capacity;
+	size_t last = end % capacity;
+	Node result;
+	if (first < last) {
+		result = query(channel, first, last);
+	} else {
+		Node head = query(channel, first, capacity);
+		Node tail = query(channel, 0, last);
+		result.min = std::min(head.min, tail.min);
+		result.max = std::max(head.max, tail.max);
+		result.sum = head.sum + tail.sum;
+	}
+
+	aggregate.count = end - begin;
+	aggregate.min = result.min;
+	aggregate.max = result.max;
+	aggregate.mean = result.sum / (double) aggregate.count;
+	return true;
+}
+
+bool SensorHistory::getAggregate(Macro::StreamingMasks sensor,
+		Clock::duration span, SensorAggregate &aggregate) const {
+	Clock::time_point latest;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (count == 0) {
+			return false;
+		}
+		latest = times[(count - 1) % capacity];
+	}
+
+	return getAggregate(sensor, latest - span, latest + Clock::duration(1), aggregate);
+}
+
+size_t SensorHistory::getSamples(Macro::StreamingMasks sensor,
+		Clock::time_point from, Clock::time_point to,
+		std::vector<SensorSample> &samples) const {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	int channel = SensorData::getChannelIndex(mask, sensor);
+	if (channel == -1 || count == 0) {
+		return 0;
+	}
+	const Node *tree = &trees[channel * capacity * 2];
+
+	uint64_t begin = lowerBound(from);
+	uint64_t end = lowerBound(to);
+	for (uint64_t i = begin; i < end; i++) {
+		SensorSample sample = { times[i % capacity], tree[i % capacity + capacity].min };
+		samples.push_back(sample);
+	}
+	return end - begin;
+}
+
+}
@@ -0,0 +1,253 @@
+
+/*
+Copyright (C) 2012 Antonio Zea, akzeac@gmail.com, Karlsruhe Institute of Technology
+This code borrows heavily from code by Nicklas Gavelin, nicklas.gavelin@gmail.com,
+Luleå University of Technology
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <algorithm>
+#include "libSphero.h"
+
+namespace LibSphero {
+
+void SensorMerger::Source::onPacketReceived(const Response::Message &) {
+}
+
+void SensorMerger::Source::onSensorData(const SensorData &data) {
+	merger->push(input, data);
+}
+
+SensorMerger::SensorMerger(IMergeListener &_listener, const MergeOptions &_options) :
+	listener(_listener),
+	options(_options),
+	lateFrames(0) {
+	options.capacity = std::max<size_t>(options.capacity, 1);
+}
+
+SensorMerger::~SensorMerger() {
+	for (Source *source : sources) {
+		source->robot->removeListener(*source);
+		delete source;
+	}
+}
+
+size_t SensorMerger::addInput(Robot &robot) {
+	size_t input = addInput();
+
+	Source *source = new Source();
+	source->merger = this;
+	source->robot = &robot;
+	source->input = input;
+	sources.push_back(source);
+	robot.addListener(*source);
+
+	return input;
+}
+
+size_t SensorMerger::addInput() {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// Silent from the start, so the input is waited for as long as any other
+	Queue queue;
+	queue.frames.resize(options.capacity);
+	queue.head = 0;
+	queue.size = 0;
+	queue.latest = Clock::now();
+	queue.position = -1;
+	queues.push_back(queue);
+
+	size_t input = queues.size() - 1;
+	insert(input);
+	return input;
+}
+
+void SensorMerger::push(size_t input, const SensorData &data) {
+	std::lock_guard<std::mutex> lock(mutex);
+	Queue &queue = queues[input];
+	size_t channels = std::min<size_t>(data.getChannelCount(), MergedFrame::MAX_CHANNELS);
+
+	for (size_t frame = 0; frame < data.getFrameCount(); frame++) {
+		Clock::time_point time = std::max(data.getSampleTime(frame), queue.latest);
+		if (queue.position == -1 && time < watermark) {
+			lateFrames++;
+			continue;
+		}
+
+		// A full input forces the others out until it has room
+		while (queue.size == options.capacity) {
+			releaseTop(Clock::time_point::max());
+		}
+
+		MergedFrame &merged = queue.frames[(queue.head + queue.size) % options.capacity];
+		merged.input = input;
+		merged.time = time;
+		merged.mask = data.getMask();
+		merged.channels = channels;
+		for (size_t channel = 0; channel < channels; channel++) {
+			merged.values[channel] = data.getValue(channel, frame);
+		}
+		queue.size++;
+		queue.latest = time;
+		newest = std::max(newest, time);
+
+		// The key only changes when the frame becomes the oldest one
+		if (queue.position == -1) {
+			insert(input);
+		} else if (queue.size == 1) {
+			siftDown(queue.position);
+		}
+	}
+
+	Clock::time_point limit = newest - std::chrono::milliseconds(options.lateness);
+	while (releaseTop(limit)) {
+	}
+}
+
+void SensorMerger::advance(Clock::time_point now) {
+	std::lock_guard<std::mutex> lock(mutex);
+	Clock::time_point limit = now - std::chrono::milliseconds(options.lateness);
+	while (releaseTop(limit)) {
+	}
+}
+
+void SensorMerger::flush() {
+	std::lock_guard<std::mutex> lock(mutex);
+	while (releaseTop(Clock::time_point::max())) {
+	}
+}
+
+SensorMerger::Clock::time_point SensorMerger::getWatermark() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return watermark;
+}
+
+size_t SensorMerger::getPendingFrames() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	size_t pending = 0;
+	for (const Queue &queue : queues) {
+		pending += queue.size;
+	}
+	return pending;
+}
+
+uint64_t SensorMerger::getLateFrames() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return lateFrames;
+}
+
+void SensorMerger::onTick(const TickInfo &) {
+	advance(Clock::now());
+}
+
+bool SensorMerger::releaseTop(Clock::time_point limit) {
+	if (heap.empty()) {
+		return false;
+	}
+
+	// Every other input has, or has promised, nothing older than the top
+	size_t input = heap[0];
+	Queue &queue = queues[input];
+	if (queue.size == 0) {
+		if (queue.latest > limit) {
+			return false;
+		}
+		removeTop();
+		return true;
+	}
+
+	MergedFrame &frame = queue.frames[queue.head];
+	watermark = frame.time;
+	listener.onMergedFrame(frame);
+
+	queue.head = (queue.head + 1) % options.capacity;
+	queue.size--;
+	siftDown(0);
+	return true;
+}
+
+SensorMerger::Clock::time_point SensorMerger::getKey(size_t input) const {
+	const Queue &queue = queues[input];
+	return queue.size == 0 ? queue.latest : queue.frames[queue.head].time;
+}
+
+bool SensorMerger::isBefore(size_t a, size_t b) const {
+	Clock::time_point keyA = getKey(a);
+	Clock::time_point keyB = getKey(b);
+
+	// Frames go before inputs waiting at the same time, whose frames can
+	// only be as old
+	if (keyA != keyB) {
+		return keyA < keyB;
+	} else if ((queues[a].size == 0) != (queues[b].size == 0)) {
+		return queues[b].size == 0;
+	}
+	return a < b;
+}
+
+void SensorMerger::place(size_t index, size_t input) {
+	heap[index] = input;
+	queues[input].position = index;
+}
+
+void SensorMerger::siftUp(size_t index) {
+	size_t input = heap[index];
+	while (index > 0) {
+		size_t parent = (index - 1) / 2;
+		if (!isBefore(input, heap[parent])) {
+			break;
+		}
+		place(index, heap[parent]);
+		index = parent;
+	}
+	place(index, input);
+}
+
+void SensorMerger::siftDown(size_t index) {
+	size_t input = heap[index];
+	for (;;) {
+		size_t child = index * 2 + 1;
+		if (child >= heap.size()) {
+			break;
+		}
+		if (child + 1 < heap.size() && isBefore(heap[child + 1], heap[child])) {
+			child++;
+		}
+		if (!isBefore(heap[child], input)) {
+			break;
+		}
+		place(index, heap[child]);
+		index = child;
+	}
+	place(index, input);
+}
+
+void SensorMerger::insert(size_t input) {
+	heap.push_back(input);
+	siftUp(heap.size() - 1);
+}
+
+void SensorMerger::removeTop() {
+	queues[heap[0]].position = -1;
+	size_t last = heap.back();
+	heap.pop_back();
+	if (!heap.empty()) {
+		place(0, last);
+		siftDown(0);
+	}
+}
+
+}
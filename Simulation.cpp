@@ -0,0 +1,295 @@
+
+/*
+Copyright (C) 2012 Antonio Zea, akzeac@gmail.com, Karlsruhe Institute of Technology
+This code borrows heavily from code by Nicklas Gavelin, nicklas.gavelin@gmail.com,
+Luleå University of Technology
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <algorithm>
+#include "libSphero.h"
+
+namespace LibSphero {
+
+/* Fields of a command packet */
+static const size_t DEVICE_ID_INDEX = 2;
+static const size_t COMMAND_ID_INDEX = 3;
+static const size_t SEQUENCE_NUMBER_INDEX = 4;
+
+/* Device and command IDs of SET_DATA_STREAMING */
+static const uint8_t STREAMING_DEVICE = 2;
+static const uint8_t STREAMING_COMMAND = 17;
+static const size_t STREAMING_PAYLOAD_LENGTH = 9;
+
+/* Response ID of streamed sensor data */
+static const uint8_t DATA_RESPONSE = 3;
+
+/* Receives the packets of robots attached without a listener */
+static IListener &getIgnoringListener() {
+	struct Ignoring : public IListener {
+		virtual void onPacketReceived(const Response::Message &/* message */) {}
+	};
+	static Ignoring listener;
+	return listener;
+}
+
+/** Appends the checksum of the bytes after the two start bytes */
+static void appendChecksum(ByteArrayBuffer &packet) {
+	uint8_t sum = 0;
+	for (size_t i = 2; i < packet.size(); i++) {
+		sum += packet[i];
+	}
+	packet.push_back(~sum);
+}
+
+Simulation::Simulation(uint32_t seed) :
+	scheduled(0),
+	processed(0),
+	random(seed * 0x9E3779B97F4A7C15ull + 1),
+	emulations(0) {
+}
+
+Simulation::~Simulation() {
+	while (!robots.empty()) {
+		detach(*robots.begin()->first);
+	}
+}
+
+double Simulation::uniform() {
+	// xorshift64*, so runs do not depend on the standard library
+	random ^= random >> 12;
+	random ^= random << 25;
+	random ^= random >> 27;
+	return ((random * 0x2545F4914F6CDD1Dull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void Simulation::schedule(Clock::time_point when, std::function<void()> action) {
+	Event event;
+	event.when = std::max(when, time);
+	event.order = scheduled++;
+
+	if (freeActions.empty()) {
+		event.action = actions.size();
+		actions.push_back(std::move(action));
+	} else {
+		event.action = freeActions.back();
+		freeActions.pop_back();
+		actions[event.action].swap(action);
+	}
+
+	events.push_back(event);
+	std::push_heap(events.begin(), events.end());
+}
+
+void Simulation::schedule(Clock::duration delay, std::function<void()> action) {
+	schedule(time + delay, std::move(action));
+}
+
+bool Simulation::step() {
+	if (events.empty()) {
+		return false;
+	}
+
+	// Taken off the queue first, so the action can schedule others
+	std::pop_heap(events.begin(), events.end());
+	Event event = events.back();
+	events.pop_back();
+
+	std::function<void()> action;
+	action.swap(actions[event.action]);
+	freeActions.push_back(event.action);
+
+	time = event.when;
+	processed++;
+	action();
+	return true;
+}
+
+void Simulation::runUntil(Clock::time_point when) {
+	while (!events.empty() && events.front().when <= when) {
+		step();
+	}
+	time = std::max(time, when);
+}
+
+void Simulation::runFor(Clock::duration duration) {
+	runUntil(time + duration);
+}
+
+void Simulation::attach(Robot &robot, const std::string &address,
+		const EmulationOptions &options, IListener *listener) {
+	if (robot.simulation) {
+		robot.simulation->detach(robot);
+	} else {
+		robot.disconnect();
+	}
+
+	Emulation emulation;
+	emulation.id = emulations++;
+	emulation.options = options;
+	emulation.listener = listener ? listener : &getIgnoringListener();
+	emulation.uplink.free = emulation.uplink.arrival = time;
+	emulation.downlink.free = emulation.downlink.arrival = time;
+	emulation.stream = 0;
+	emulation.counter = 0;
+	robots[&robot] = emulation;
+
+	robot.address = address;
+	robot.simulation = this;
+	robot.storeInFleet();
+}
+
+void Simulation::detach(Robot &robot) {
+	if (robots.erase(&robot) != 0) {
+		robot.simulation = 0;
+		robot.storeInFleet();
+	}
+}
+
+Simulation::Emulation *Simulation::find(Robot *robot, uint64_t id) {
+	std::unordered_map<Robot*, Emulation>::iterator it = robots.find(robot);
+	return it != robots.end() && it->second.id == id ? &it->second : 0;
+}
+
+Simulation::Clock::time_point Simulation::carry(Link &link,
+		const EmulationOptions &options, Clock::time_point start, size_t bytes) {
+	typedef std::chrono::duration<double, std::milli> Milliseconds;
+
+	// Packets queue up behind each other, and never overtake each other
+	link.free = std::max(link.free, start) + std::chrono::duration_cast<Clock::duration>(
+			std::chrono::duration<double>(bytes / options.bandwidth));
+	Clock::time_point arrival = link.free + std::chrono::duration_cast<Clock::duration>(
+			Milliseconds(options.latency + options.jitter * uniform()));
+	link.arrival = std::max(link.arrival, arrival);
+	return link.arrival;
+}
+
+void Simulation::transmit(Robot &robot, const uint8_t *packet, size_t length) {
+	std::unordered_map<Robot*, Emulation>::iterator it = robots.find(&robot);
+	if (it == robots.end()) {
+		return;
+	}
+	Emulation *emulation = &it->second;
+
+	Clock::time_point arrival = carry(emulation->uplink, emulation->options, time, length);
+	if (uniform() < emulation->options.loss) {
+		return;
+	}
+
+	Robot *target = &robot;
+	uint64_t id = emulation->id;
+	ByteArrayBuffer command(packet, packet + length);
+	schedule(arrival, [this, target, id, command] { execute(target, id, command); });
+}
+
+void Simulation::execute(Robot *robot, uint64_t id, const ByteArrayBuffer &packet) {
+	Emulation *emulation = find(robot, id);
+	if (!emulation) {
+		return;
+	}
+
+	const size_t header = Command::Message::getHeaderLength();
+	const uint8_t *payload = &packet[header];
+	size_t payloadLength = packet.size() - header - 1;
+
+	if (packet[DEVICE_ID_INDEX] == STREAMING_DEVICE
+			&& packet[COMMAND_ID_INDEX] == STREAMING_COMMAND
+			&& payloadLength == STREAMING_PAYLOAD_LENGTH) {
+		uint16_t divisor = (payload[0] << 8) + payload[1];
+		uint16_t frames = (payload[2] << 8) + payload[3];
+		int mask = (payload[4] << 24) + (payload[5] << 16) + (payload[6] << 8) + payload[7];
+
+		unsigned int number = ++emulation->stream;
+		if (divisor != 0 && frames != 0 && mask != 0) {
+			unsigned int remaining = payload[8];
+			schedule(time, [this, robot, id, number, divisor, frames, mask, remaining] {
+				stream(robot, id, number, divisor, frames, mask, remaining);
+			});
+		}
+	}
+
+	ByteArrayBuffer response = { 0xFF, 0xFF, 0, packet[SEQUENCE_NUMBER_INDEX], 1 };
+	appendChecksum(response);
+
+	Clock::time_point arrival = carry(emulation->downlink, emulation->options,
+			time, response.size());
+	schedule(arrival, [this, robot, id, response] { deliver(robot, id, response); });
+}
+
+void Simulation::stream(Robot *robot, uint64_t id, unsigned int number,
+		uint16_t divisor, uint16_t frames, int mask, unsigned int remaining) {
+	Emulation *emulation = find(robot, id);
+	if (!emulation || emulation->stream != number) {
+		return;
+	}
+
+	size_t channels = SensorData::countChannels(mask);
+	size_t length = frames * channels * 2 + 1;
+
+	ByteArrayBuffer packet = { 0xFF, 0xFE, DATA_RESPONSE,
+			(uint8_t)(length >> 8), (uint8_t)length };
+	for (size_t i = 0; i < frames * channels; i++) {
+		int16_t value = emulation->counter++;
+		packet.push_back((uint8_t)(value >> 8));
+		packet.push_back((uint8_t)value);
+	}
+	appendChecksum(packet);
+
+	Clock::time_point arrival = carry(emulation->downlink, emulation->options,
+			time, packet.size());
+	schedule(arrival, [this, robot, id, packet] { deliver(robot, id, packet); });
+
+	// A count of 0 streams until streaming is changed
+	if (remaining != 1) {
+		unsigned int next = remaining == 0 ? 0 : remaining - 1;
+		schedule(time + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(
+				(double) divisor * frames / SensorData::BASE_RATE)),
+				[this, robot, id, number, divisor, frames, mask, next] {
+					stream(robot, id, number, divisor, frames, mask, next);
+				});
+	}
+}
+
+void Simulation::deliver(Robot *robot, uint64_t id, const ByteArrayBuffer &packet) {
+	Emulation *emulation = find(robot, id);
+	if (!emulation) {
+		return;
+	}
+
+	Response::Message message(packet);
+	message.setTimestamp(time);
+	robot->dispatch(*emulation->listener, message);
+}
+
+void Simulation::retryAt(Robot &robot, Clock::time_point when) {
+	std::unordered_map<Robot*, Emulation>::iterator it = robots.find(&robot);
+	if (it == robots.end()) {
+		return;
+	}
+
+	Robot *target = &robot;
+	uint64_t id = it->second.id;
+	schedule(when, [this, target, id] { retry(target, id); });
+}
+
+void Simulation::retry(Robot *robot, uint64_t id) {
+	Emulation *emulation = find(robot, id);
+	if (emulation) {
+		robot->retransmit(*emulation->listener);
+	}
+}
+
+}
@@ -0,0 +1,204 @@
+
+/*
+Copyright (C) 2012 Antonio Zea, akzeac@gmail.com, Karlsruhe Institute of Technology
+This code borrows heavily from code by Nicklas Gavelin, nicklas.gavelin@gmail.com,
+Luleå University of Technology
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+#include "libSphero.h"
+
+namespace LibSphero {
+
+/* Healthy intervals needed before the link is pushed further */
+static const unsigned int PROBE_INTERVALS = 3;
+
+/* Share of the expected packets below which the link is not keeping up */
+static const double MIN_DELIVERY = 0.9;
+
+/* Packets that must be expected within a measurement */
+static const double MIN_PACKETS = 8;
+
+StreamingController::StreamingController(Robot &_robot, const StreamingBounds &_bounds,
+		Heartbeat *_heartbeat, IStreamingListener *_listener) :
+	robot(_robot),
+	bounds(_bounds),
+	heartbeat(_heartbeat),
+	listener(_listener),
+	running(false),
+	healthy(0),
+	packets(0),
+	bytes(0),
+	gapSum(0),
+	gapSquares(0),
+	gaps(0) {
+	memset(&point, 0, sizeof(point));
+	point.divisor = bounds.maxDivisor;
+	point.frames = bounds.minFrames;
+}
+
+StreamingController::~StreamingController() {
+	stop();
+}
+
+void StreamingController::start() {
+	std::lock_guard<std::mutex> commandLock(commandMutex);
+	std::unique_lock<std::mutex> lock(mutex);
+	if (running) {
+		return;
+	}
+	running = true;
+	Command::Message command = apply();
+	lock.unlock();
+
+	robot.addListener(*this);
+	robot.send(command);
+}
+
+void StreamingController::stop() {
+	std::lock_guard<std::mutex> commandLock(commandMutex);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!running) {
+			return;
+		}
+		running = false;
+	}
+	robot.removeListener(*this);
+	robot.send(Macro::setDataStreaming(0, 0, Macro::OFF, 0));
+}
+
+StreamingPoint StreamingController::getOperatingPoint() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return point;
+}
+
+Command::Message StreamingController::apply() {
+	point.expectedRate = SensorData::BASE_RATE / (double) point.divisor / point.frames;
+	resetWindow(Clock::now());
+	return Macro::setDataStreaming(point.divisor, point.frames, bounds.mask, 0);
+}
+
+void StreamingController::resetWindow(Clock::time_point now) {
+	windowStart = now;
+	lastPacket = Clock::time_point();
+	packets = 0;
+	bytes = 0;
+	gapSum = 0;
+	gapSquares = 0;
+	gaps = 0;
+}
+
+void StreamingController::onPacketReceived(const Response::Message &) {
+}
+
+void StreamingController::onSensorData(const SensorData &data) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// Packets of an earlier configuration would distort the measurements
+	if (data.getMask() != bounds.mask || data.getFrameCount() != point.frames
+			|| data.getTimestamp() < windowStart) {
+		return;
+	}
+
+	packets++;
+	bytes += data.getFrameCount() * data.getChannelCount() * 2;
+
+	if (lastPacket != Clock::time_point()) {
+		double gap = std::chrono::duration<double>(data.getTimestamp() - lastPacket).count();
+		gapSum += gap;
+		gapSquares += gap * gap;
+		gaps++;
+	}
+	lastPacket = data.getTimestamp();
+}
+
+void StreamingController::onTick(const TickInfo &) {
+	std::lock_guard<std::mutex> commandLock(commandMutex);
+	std::unique_lock<std::mutex> lock(mutex);
+
+	Clock::time_point now = Clock::now();
+	double elapsed = std::chrono::duration<double>(now - windowStart).count();
+	double expectedGap = 1.0 / point.expectedRate;
+
+	// Slow configurations are measured for longer, to get enough packets
+	if (!running || elapsed < std::max(bounds.interval / 1000.0, MIN_PACKETS * expectedGap)) {
+		return;
+	}
+
+	// The rate comes from the gaps, since the first packet may come late
+	point.packetRate = gaps > 0 ? gaps / gapSum : packets / elapsed;
+	point.throughput = bytes / elapsed;
+	point.latency = heartbeat ? heartbeat->getQuality().rtt : 0;
+
+	point.gapDeviation = 0;
+	if (gaps > 1) {
+		double mean = gapSum / gaps;
+		double variance = std::max(0.0, gapSquares / gaps - mean * mean);
+		point.gapDeviation = std::sqrt(variance) / expectedGap;
+	}
+
+	// Packets that stopped coming are not reflected by the earlier gaps
+	if (lastPacket == Clock::time_point()
+			|| std::chrono::duration<double>(now - lastPacket).count() > 2 * expectedGap) {
+		point.packetRate = std::min(point.packetRate, packets / elapsed);
+	}
+
+	bool saturated = point.packetRate < point.expectedRate * MIN_DELIVERY
+			|| point.gapDeviation > bounds.maxGapDeviation
+			|| (heartbeat && point.latency > bounds.maxLatency);
+
+	uint16_t divisor = point.divisor;
+	uint16_t frames = point.frames;
+
+	if (saturated) {
+		// Batching saves the per-packet overhead without losing samples
+		healthy = 0;
+		if (frames < bounds.maxFrames) {
+			frames = std::min<int>(frames * 2, bounds.maxFrames);
+		} else {
+			divisor = std::min<int>(divisor + divisor / 2 + 1, bounds.maxDivisor);
+		}
+	} else if (++healthy >= PROBE_INTERVALS) {
+		healthy = 0;
+		if (divisor > bounds.minDivisor) {
+			divisor = std::max<int>(divisor - std::max(divisor / 4, 1), bounds.minDivisor);
+		} else if (frames > bounds.minFrames) {
+			frames--;
+		}
+	}
+
+	if (divisor == point.divisor && frames == point.frames) {
+		resetWindow(now);
+		return;
+	}
+
+	point.divisor = divisor;
+	point.frames = frames;
+	Command::Message command = apply();
+	StreamingPoint current = point;
+	lock.unlock();
+
+	robot.send(command);
+	if (listener) {
+		listener->onStreamingChanged(robot, current);
+	}
+}
+
+}
@@ -0,0 +1,270 @@
+
+/*
+Copyright (C) 2012 Antonio Zea, akzeac@gmail.com, Karlsruhe Institute of Technology
+This code borrows heavily from code by Nicklas Gavelin, nicklas.gavelin@gmail.com,
+Luleå University of Technology
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <iostream>
+#include <algorithm>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "libSphero.h"
+
+namespace LibSphero {
+
+namespace {
+
+const uint32_t TELEMETRY_MAGIC = 0x54485053; // "SPHT"
+const uint32_t TELEMETRY_VERSION = 1;
+
+/** A frame of the ring. The sequence is odd while the slot is being written. */
+struct Slot {
+	uint32_t sequence;
+	uint64_t index;
+	TelemetryFrame frame;
+};
+
+/** Layout of the shared memory segment */
+struct Segment {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t capacity;
+	uint32_t stateSequence;
+	int64_t stateTimestamp;
+	RobotState state;
+	uint64_t frameCount;
+	Slot slots[1];
+};
+
+size_t getSegmentSize(uint32_t capacity) {
+	return offsetof(Segment, slots) + capacity * sizeof(Slot);
+}
+
+int64_t getTimestamp(std::chrono::steady_clock::time_point time) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			time.time_since_epoch()).count();
+}
+
+void beginWrite(uint32_t &sequence) {
+	__atomic_store_n(&sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void endWrite(uint32_t &sequence) {
+	__atomic_store_n(&sequence, sequence + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t beginRead(const uint32_t &sequence) {
+	uint32_t value;
+	while ((value = __atomic_load_n(&sequence, __ATOMIC_ACQUIRE)) & 1) {
+	}
+	return value;
+}
+
+bool endRead(const uint32_t &sequence, uint32_t value) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&sequence, __ATOMIC_RELAXED) == value;
+}
+
+}
+
+TelemetryPublisher::TelemetryPublisher(Robot &_robot, const std::string &_name,
+		uint32_t capacity) :
+	robot(_robot),
+	name(_name),
+	memory(0),
+	size(0) {
+	capacity = std::max(capacity, 1u);
+	size = getSegmentSize(capacity);
+
+	int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+	if (fd == -1) {
+		std::cout << "TelemetryPublisher: Failed to open '" << name << "'!" << std::endl;
+		return;
+	}
+
+	if (ftruncate(fd, size) == 0) {
+		void *mapped = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (mapped != MAP_FAILED) {
+			memory = mapped;
+		}
+	}
+	close(fd);
+
+	if (!memory) {
+		std::cout << "TelemetryPublisher: Failed to map '" << name << "'!" << std::endl;
+		shm_unlink(name.c_str());
+		return;
+	}
+
+	Segment *segment = (Segment *) memory;
+	memset(segment, 0, size);
+	segment->capacity = capacity;
+	segment->version = TELEMETRY_VERSION;
+	publishState();
+
+	// Readers check the magic last, once everything else is in place
+	__atomic_store_n(&segment->magic, TELEMETRY_MAGIC, __ATOMIC_RELEASE);
+
+	robot.addListener(*this);
+}
+
+TelemetryPublisher::~TelemetryPublisher() {
+	if (memory) {
+		robot.removeListener(*this);
+		munmap(memory, size);
+		shm_unlink(name.c_str());
+	}
+}
+
+void TelemetryPublisher::publishState() {
+	Segment *segment = (Segment *) memory;
+	if (!segment) {
+		return;
+	}
+
+	// Copied first, as senders on other threads change the state
+	RobotState state = robot.copyState();
+
+	beginWrite(segment->stateSequence);
+	segment->state = state;
+	segment->stateTimestamp = getTimestamp(std::chrono::steady_clock::now());
+	endWrite(segment->stateSequence);
+}
+
+void TelemetryPublisher::onPacketReceived(const Response::Message &) {
+	publishState();
+}
+
+void TelemetryPublisher::onSensorData(const SensorData &data) {
+	Segment *segment = (Segment *) memory;
+	if (!segment) {
+		return;
+	}
+
+	uint64_t count = segment->frameCount;
+
+	for (size_t frame = 0; frame < data.getFrameCount(); frame++) {
+		Slot &slot = segment->slots[count % segment->capacity];
+
+		beginWrite(slot.sequence);
+		slot.index = count;
+		slot.frame.timestamp = getTimestamp(data.getSampleTime(frame));
+		slot.frame.mask = data.getMask();
+		slot.frame.channels = data.getChannelCount();
+		for (size_t channel = 0; channel < data.getChannelCount(); channel++) {
+			slot.frame.values[channel] = data.getValue(channel, frame);
+		}
+		endWrite(slot.sequence);
+
+		__atomic_store_n(&segment->frameCount, ++count, __ATOMIC_RELEASE);
+	}
+}
+
+TelemetryReader::TelemetryReader(const std::string &name) :
+	memory(0),
+	size(0) {
+	int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if (fd == -1) {
+		std::cout << "TelemetryReader: Failed to open '" << name << "'!" << std::endl;
+		return;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) == 0 && (size_t) info.st_size >= getSegmentSize(1)) {
+		void *mapped = mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (mapped != MAP_FAILED) {
+			memory = mapped;
+			size = info.st_size;
+		}
+	}
+	close(fd);
+
+	const Segment *segment = (const Segment *) memory;
+	if (segment && (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != TELEMETRY_MAGIC
+			|| segment->version != TELEMETRY_VERSION
+			|| getSegmentSize(segment->capacity) > size)) {
+		std::cout << "TelemetryReader: Invalid segment '" << name << "'!" << std::endl;
+		munmap(memory, size);
+		memory = 0;
+	}
+}
+
+TelemetryReader::~TelemetryReader() {
+	if (memory) {
+		munmap(memory, size);
+	}
+}
+
+uint64_t TelemetryReader::getFrameCount() const {
+	const Segment *segment = (const Segment *) memory;
+	if (!segment) {
+		return 0;
+	}
+	return __atomic_load_n(&segment->frameCount, __ATOMIC_ACQUIRE);
+}
+
+bool TelemetryReader::readFrame(uint64_t index, TelemetryFrame &frame) const {
+	const Segment *segment = (const Segment *) memory;
+	if (!segment || index >= getFrameCount()) {
+		return false;
+	}
+
+	const Slot &slot = segment->slots[index % segment->capacity];
+	uint64_t stored;
+	uint32_t sequence;
+	do {
+		sequence = beginRead(slot.sequence);
+		stored = slot.index;
+		frame = slot.frame;
+	} while (!endRead(slot.sequence, sequence));
+
+	// The slot may hold a newer frame if the reader fell behind
+	return stored == index;
+}
+
+bool TelemetryReader::readLatestFrame(TelemetryFrame &frame) const {
+	uint64_t count = getFrameCount();
+	return count > 0 && readFrame(count - 1, frame);
+}
+
+bool TelemetryReader::readState(RobotState &state, int64_t *timestamp) const {
+	const Segment *segment = (const Segment *) memory;
+	if (!segment) {
+		return false;
+	}
+
+	uint32_t sequence;
+	int64_t published;
+	do {
+		sequence = beginRead(segment->stateSequence);
+		state = segment->state;
+		published = segment->stateTimestamp;
+	} while (!endRead(segment->stateSequence, sequence));
+
+	if (timestamp) {
+		*timestamp = published;
+	}
+	return true;
+}
+
+}
@@ -0,0 +1,42 @@
+
+/*
+Copyright (C) 2012 Antonio Zea, akzeac@gmail.com, Karlsruhe Institute of Technology
+This code borrows heavily from code by Nicklas Gavelin, nicklas.gavelin@gmail.com,
+Luleå University of Technology
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "Tracing.h"
+
+#ifdef SPHERO_TRACING
+
+/* Probe semaphores, counted up by the tools attached to each probe */
+#define SPHERO_DEFINE_PROBE(name) \
+	__extension__ unsigned short SPHERO_SEMAPHORE(name) \
+			__attribute__((unused)) __attribute__((section(".probes"))) = 0
+
+extern "C" {
+
+SPHERO_DEFINE_PROBE(send);
+SPHERO_DEFINE_PROBE(read);
+SPHERO_DEFINE_PROBE(parse);
+SPHERO_DEFINE_PROBE(checksum_failure);
+SPHERO_DEFINE_PROBE(dispatch_entry);
+SPHERO_DEFINE_PROBE(dispatch_return);
+
+}
+
+#endif
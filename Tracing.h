@@ -0,0 +1,60 @@
+
+/*
+Copyright (C) 2012 Antonio Zea, akzeac@gmail.com, Karlsruhe Institute of Technology
+This code borrows heavily from code by Nicklas Gavelin, nicklas.gavelin@gmail.com,
+Luleå University of Technology
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef LIBSPHERO_TRACING_H_
+#define LIBSPHERO_TRACING_H_
+
+/* Static probes for perf, bpftrace and SystemTap, in the 'libsphero'
+ * provider. They are only compiled in with SPHERO_TRACING, and then cost a
+ * nop each until a tool attaches. Probes whose arguments are expensive to
+ * compute are guarded by SPHERO_PROBE_ENABLED, which reads the semaphore
+ * that attached tools increment. */
+#ifdef SPHERO_TRACING
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define SPHERO_SEMAPHORE(name) libsphero_##name##_semaphore
+
+/* Declares a probe semaphore. Semaphores are defined in Tracing.cpp. */
+#define SPHERO_DECLARE_PROBE(name) \
+	extern "C" unsigned short SPHERO_SEMAPHORE(name)
+
+SPHERO_DECLARE_PROBE(send);
+SPHERO_DECLARE_PROBE(read);
+SPHERO_DECLARE_PROBE(parse);
+SPHERO_DECLARE_PROBE(checksum_failure);
+SPHERO_DECLARE_PROBE(dispatch_entry);
+SPHERO_DECLARE_PROBE(dispatch_return);
+
+#define SPHERO_PROBE_ENABLED(name) __builtin_expect(SPHERO_SEMAPHORE(name) != 0, 0)
+#define SPHERO_PROBE2(name, a, b) DTRACE_PROBE2(libsphero, name, a, b)
+#define SPHERO_PROBE3(name, a, b, c) DTRACE_PROBE3(libsphero, name, a, b, c)
+
+#else
+
+#define SPHERO_PROBE_ENABLED(name) false
+#define SPHERO_PROBE2(name, a, b) do {} while (0)
+#define SPHERO_PROBE3(name, a, b, c) do {} while (0)
+
+#endif
+
+#endif /* LIBSPHERO_TRACING_H_ */
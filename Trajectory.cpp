@@ -0,0 +1,189 @@
+
+/*
+Copyright (C) 2012 Antonio Zea, akzeac@gmail.com, Karlsruhe Institute of Technology
+This code borrows heavily from code by Nicklas Gavelin, nicklas.gavelin@gmail.com,
+Luleå University of Technology
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include "libSphero.h"
+
+namespace LibSphero {
+
+WaypointList::WaypointList(const std::vector<Waypoint> &_waypoints) :
+	waypoints(_waypoints),
+	index(0) {
+}
+
+void WaypointList::add(double time, double x, double y) {
+	Waypoint waypoint = { time, x, y };
+	waypoints.push_back(waypoint);
+}
+
+bool WaypointList::next(Waypoint &waypoint) {
+	if (index == waypoints.size()) {
+		return false;
+	}
+	waypoint = waypoints[index++];
+	return true;
+}
+
+TrajectoryFollower::TrajectoryFollower(Robot &_robot, IWaypointSource &_source,
+		const TrajectoryOptions &_options) :
+	robot(_robot),
+	source(_source),
+	options(_options),
+	started(false),
+	exhausted(false),
+	finished(false),
+	sent(false),
+	lastHeading(0),
+	lastSpeed(0) {
+	// The speed is the distance covered within the lookahead
+	if (!(options.lookahead > 0)) {
+		std::cout << "TrajectoryFollower: Invalid lookahead " << options.lookahead
+				<< "!" << std::endl;
+		options.lookahead = TrajectoryOptions().lookahead;
+	}
+}
+
+TrajectoryFollower::~TrajectoryFollower() {
+}
+
+bool TrajectoryFollower::fill(double time) {
+	// Keeps one waypoint before the current segment, for the spline tangents
+	while (window.size() > 2 && window[2].time <= time) {
+		window.pop_front();
+	}
+
+	// ...and two after the point looked at
+	while (!exhausted && (window.size() < 4
+			|| window[window.size() - 2].time <= time + options.lookahead)) {
+		Waypoint waypoint;
+		if (source.next(waypoint)) {
+			window.push_back(waypoint);
+		} else {
+			exhausted = true;
+		}
+	}
+
+	return !window.empty();
+}
+
+void TrajectoryFollower::interpolate(double time, double &x, double &y) const {
+	if (time <= window.front().time) {
+		x = window.front().x;
+		y = window.front().y;
+		return;
+	}
+
+	size_t i = 0;
+	while (i + 1 < window.size() && window[i + 1].time <= time) {
+		i++;
+	}
+	if (i + 1 == window.size()) {
+		x = window.back().x;
+		y = window.back().y;
+		return;
+	}
+
+	const Waypoint &p1 = window[i];
+	const Waypoint &p2 = window[i + 1];
+	double span = p2.time - p1.time;
+	double u = span > 0 ? (time - p1.time) / span : 1;
+
+	if (!options.spline) {
+		x = p1.x + (p2.x - p1.x) * u;
+		y = p1.y + (p2.y - p1.y) * u;
+		return;
+	}
+
+	// Cubic Hermite segment with Catmull-Rom tangents for uneven spacing
+	const Waypoint &p0 = window[i > 0 ? i - 1 : i];
+	const Waypoint &p3 = window[i + 2 < window.size() ? i + 2 : i + 1];
+
+	double d1 = p2.time - p0.time;
+	double d2 = p3.time - p1.time;
+	double m1x = d1 > 0 ? (p2.x - p0.x) / d1 * span : 0;
+	double m1y = d1 > 0 ? (p2.y - p0.y) / d1 * span : 0;
+	double m2x = d2 > 0 ? (p3.x - p1.x) / d2 * span : 0;
+	double m2y = d2 > 0 ? (p3.y - p1.y) / d2 * span : 0;
+
+	double u2 = u * u;
+	double u3 = u2 * u;
+	double h00 = 2 * u3 - 3 * u2 + 1;
+	double h10 = u3 - 2 * u2 + u;
+	double h01 = -2 * u3 + 3 * u2;
+	double h11 = u3 - u2;
+
+	x = h00 * p1.x + h10 * m1x + h01 * p2.x + h11 * m2x;
+	y = h00 * p1.y + h10 * m1y + h01 * p2.y + h11 * m2y;
+}
+
+void TrajectoryFollower::onTick(const TickInfo &info) {
+	if (finished) {
+		return;
+	}
+
+	// Deadlines rather than the current time, so the jitter does not show
+	if (!started) {
+		start = info.deadline;
+		started = true;
+	}
+	double time = std::chrono::duration<double>(info.deadline - start).count();
+
+	if (!fill(time) || (exhausted && time >= window.back().time)) {
+		robot.stop();
+		finished = true;
+		return;
+	}
+
+	double x0, y0, x1, y1;
+	interpolate(time, x0, y0);
+	interpolate(time + options.lookahead, x1, y1);
+
+	double dx = x1 - x0;
+	double dy = y1 - y0;
+	double distance = std::sqrt(dx * dx + dy * dy);
+
+	int speed = (int) std::lround(distance / options.lookahead * options.speedScale);
+	speed = std::min(speed, (int) options.maxSpeed);
+
+	// Headings are clockwise from the y axis; standing still keeps the last one
+	int heading = lastHeading;
+	if (speed > 0) {
+		heading = (int) std::lround(std::atan2(dx, dy) * 180 / M_PI);
+		heading = ((heading % 360) + 360) % 360;
+	}
+
+	int turn = std::abs(heading - lastHeading);
+	turn = std::min(turn, 360 - turn);
+
+	if (!sent || turn >= options.headingDeadband
+			|| std::abs(speed - lastSpeed) >= options.speedDeadband
+			|| (speed == 0 && lastSpeed != 0)) {
+		robot.roll(heading, (uint8_t) speed);
+		lastHeading = heading;
+		lastSpeed = speed;
+		sent = true;
+	}
+}
+
+}
@@ -22,10 +22,19 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #ifndef LIBSPHERO_H_
 #define LIBSPHERO_H_
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
 #include <ostream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <inttypes.h>
+#include <stdio.h>
 
 namespace LibSphero {
 
@@ -102,6 +111,17 @@ public:
 
 	/** Converts the message to a packet */
 	void packetize(ByteArrayBuffer &buffer, int seqNum) const;
+
+	/** Returns where, in a packet, the payload begins */
+	static size_t getHeaderLength();
+
+	/** Changes the sequence number of an already packetized message.
+	 * The checksum is adjusted instead of being recalculated. */
+	static void patchSequenceNumber(uint8_t *packet, size_t length, int seqNum);
+
+	/** Changes a payload byte of an already packetized message.
+	 * The checksum is adjusted instead of being recalculated. */
+	static void patchPayload(uint8_t *packet, size_t length, size_t index, uint8_t value);
 };
 
 }
@@ -132,7 +152,7 @@ enum class Code {
 };
 
 enum class InformationCode {
-	EMIT, DATA, INVALID
+	EMIT, DATA, DIAGNOSTICS, CONFIGURATION_BLOCK, INVALID
 };
 
 std::ostream &operator<<(std::ostream &os, Type type);
@@ -145,17 +165,25 @@ private:
 	ByteArrayBuffer packet;
 	Code code;
 	Type type;
+	Command::MessageType command;
+	std::chrono::steady_clock::time_point timestamp;
 
 public:
 	/** Returns whether the data buffer contains at least one valid packet */
 	static bool containsValidPacket(const ByteArrayBuffer &data);
 
+	/** Returns whether the data contains at least one valid packet */
+	static bool containsValidPacket(const uint8_t *data, size_t length);
+
 	/** Creates a message */
 	Message();
 
 	/** Creates a message */
 	Message(const ByteArrayBuffer &source);
 
+	/** Creates a message from the packet at the start of the data */
+	Message(const uint8_t *source, size_t length);
+
 	virtual ~Message();
 
 	/** Returns the response type */
@@ -178,6 +206,29 @@ public:
 		return &packet[0];
 	}
 
+	/** Returns when the packet was received. Robots use the time the
+	 * kernel stamped on the data where the socket supports it, so the
+	 * delay until it was read is not included. */
+	std::chrono::steady_clock::time_point getTimestamp() const {
+		return timestamp;
+	}
+
+	/** Sets when the packet was received */
+	void setTimestamp(std::chrono::steady_clock::time_point time) {
+		timestamp = time;
+	}
+
+	/** For regular responses, returns the command that was answered, or
+	 * INVALID if it is not known */
+	Command::MessageType getCommand() const {
+		return command;
+	}
+
+	/** Sets the command that was answered */
+	void setCommand(Command::MessageType answered) {
+		command = answered;
+	}
+
 	/** For information responses, returns the information code */
 	InformationCode getInformationCode() const;
 
@@ -207,6 +258,154 @@ public:
 
 };
 
+/** View over the data of a response, without the header and the checksum.
+ * Nothing is copied, so the view is only valid while the message lives. */
+class View {
+protected:
+	const uint8_t *data;
+	size_t length;
+
+public:
+	View(const Message &message);
+
+	/** Returns the data */
+	const uint8_t *getData() const {
+		return data;
+	}
+
+	/** Returns the size of the data */
+	size_t getLength() const {
+		return length;
+	}
+};
+
+/** Answer to Macro::version() */
+class VersionView : public View {
+private:
+	uint8_t get(size_t index) const {
+		return index < length ? data[index] : 0;
+	}
+
+public:
+	VersionView(const Message &message) :
+		View(message) {
+	}
+
+	/** Returns whether the data holds at least the fields up to the macro version */
+	bool isValid() const {
+		return length >= 8;
+	}
+
+	uint8_t getRecordVersion() const { return get(0); }
+	uint8_t getModel() const { return get(1); }
+	uint8_t getHardware() const { return get(2); }
+	uint8_t getMainApp() const { return get(3); }
+	uint8_t getMainAppRevision() const { return get(4); }
+	uint8_t getBootloader() const { return get(5); }
+	uint8_t getBasic() const { return get(6); }
+	uint8_t getMacro() const { return get(7); }
+
+	/** Returns the API version, or 0 if the firmware does not report it */
+	uint8_t getApiMajor() const { return get(8); }
+	uint8_t getApiMinor() const { return get(9); }
+};
+
+/** Answer to Macro::getBluetoothInfo() */
+class BluetoothInfoView : public View {
+public:
+	/** Size of the zero-padded name field */
+	static const size_t NAME_LENGTH = 16;
+
+	/** Number of hex digits in the address */
+	static const size_t ADDRESS_LENGTH = 12;
+
+	BluetoothInfoView(const Message &message) :
+		View(message) {
+	}
+
+	/** Returns whether the data holds the name and the address */
+	bool isValid() const {
+		return length >= NAME_LENGTH + ADDRESS_LENGTH;
+	}
+
+	/** Returns the name, which is not terminated */
+	const char *getName() const {
+		return (const char*) data;
+	}
+
+	/** Returns the length of the name */
+	size_t getNameLength() const;
+
+	/** Returns the address as hex digits, which are not terminated */
+	const char *getAddress() const {
+		return (const char*) data + NAME_LENGTH;
+	}
+};
+
+/** Contents of a configuration block, sent asynchronously after
+ * Macro::getConfigurationBlock(). The layout depends on the firmware, so
+ * fields are read by offset, big-endian like the rest of the protocol. */
+class ConfigurationBlockView : public View {
+public:
+	ConfigurationBlockView(const Message &message) :
+		View(message) {
+	}
+
+	/** Returns whether the data holds any block contents */
+	bool isValid() const {
+		return length > 0;
+	}
+
+	/** Returns whether the given number of bytes can be read at the offset */
+	bool contains(size_t offset, size_t size) const {
+		return offset <= length && size <= length - offset;
+	}
+
+	/** Returns the field at the given offset, or 0 if it lies past the end */
+	uint8_t getUInt8(size_t offset) const {
+		return contains(offset, 1) ? data[offset] : 0;
+	}
+	uint16_t getUInt16(size_t offset) const {
+		return contains(offset, 2) ? (data[offset] << 8) | data[offset + 1] : 0;
+	}
+	uint32_t getUInt32(size_t offset) const {
+		return contains(offset, 4) ? ((uint32_t) data[offset] << 24)
+				| (data[offset + 1] << 16) | (data[offset + 2] << 8)
+				| data[offset + 3] : 0;
+	}
+};
+
+/** Text of the level 1 diagnostics, sent asynchronously after
+ * Macro::level1Diagnostics(). The text is made of lines, most of them
+ * in the form 'name: value'. */
+class DiagnosticsView : public View {
+public:
+	DiagnosticsView(const Message &message) :
+		View(message) {
+	}
+
+	/** Returns whether the data holds any text */
+	bool isValid() const {
+		return getTextLength() > 0;
+	}
+
+	/** Returns the text, which is not terminated */
+	const char *getText() const {
+		return (const char*) data;
+	}
+
+	/** Returns the length of the text, up to a terminating zero if any */
+	size_t getTextLength() const;
+
+	/** Finds the next non-empty line, starting at the given offset, which
+	 * is moved past it. Returns false once there are no more lines. */
+	bool getLine(size_t &offset, const char *&line, size_t &lineLength) const;
+
+	/** Finds the value of the first line in the form 'name: value', without
+	 * the spaces around it. Returns false if there is no such line. */
+	bool findValue(const char *name, const char *&value, size_t &valueLength) const;
+};
+
 }
 
 struct Macro {
@@ -294,6 +493,9 @@ struct Macro {
 	/** Sets the front LED brightness (0-255) */
 	static Command::Message setFrontLED(uint8_t brightness);
 
+	/** Pings the robot, which answers with an empty response */
+	static Command::Message ping();
+
 	/** Gets the Bluetooth info  */
 	static Command::Message getBluetoothInfo();
 
@@ -328,6 +530,11 @@ struct Macro {
 	/** Runs the given macro (untested) */
 	static Command::Message runMacro(uint8_t macroId);
 
+	/** Stores a macro under the given ID, replacing the one stored before.
+	 * The macro starts with its flags and ends with the end command, and
+	 * must fit in a packet, that is, take at most 253 bytes (untested). */
+	static Command::Message saveMacro(uint8_t macroId, const ByteArrayBuffer &macro);
+
 	/** Tells the robot to stream back sensor data
 	 * @param mDivisor Divisor to divide the default sampling rate of 400 Hz
 	 * @param mPacketFrames Number of frames per packet
@@ -368,45 +575,446 @@ struct RobotState {
 	uint8_t blue;
 	uint8_t brightness;
 	bool stop;
+	bool stabilization;
+	uint16_t streamingDivisor;
+	uint16_t streamingFrames;
+	int streamingMask;
+	uint8_t streamingCount;
+};
+
+/** Sensor values of a DATA response, decoded with the streaming mask that was
+ * in effect. The values are stored channel by channel, and the channels
+ * follow the bits of the mask from the most significant one down. */
+class SensorData {
+private:
+	int mask;
+	size_t channels;
+	size_t frames;
+	std::vector<int16_t> values;
+	std::chrono::steady_clock::time_point timestamp;
+	std::chrono::steady_clock::duration period;
+
+public:
+	/** Sampling rate that the streaming divisor divides */
+	static const int BASE_RATE = 400;
+
+	SensorData();
+
+	/** Decodes a DATA response streamed with the given mask and divisor.
+	 * Returns false if the message does not match the mask. */
+	bool decode(const Response::Message &message, int mask, uint16_t divisor);
+
+	/** Returns the mask used to decode the values */
+	int getMask() const {
+		return mask;
+	}
+
+	/** Returns the number of channels */
+	size_t getChannelCount() const {
+		return channels;
+	}
+
+	/** Returns the number of frames, that is, values per channel */
+	size_t getFrameCount() const {
+		return frames;
+	}
+
+	/** Returns the values of a channel, one per frame */
+	const int16_t *getChannel(size_t channel) const {
+		return &values[channel * frames];
+	}
+
+	/** Returns the value of a channel in the given frame */
+	int16_t getValue(size_t channel, size_t frame) const {
+		return values[channel * frames + frame];
+	}
+
+	/** Returns when the packet was received */
+	std::chrono::steady_clock::time_point getTimestamp() const {
+		return timestamp;
+	}
+
+	/** Returns the time between two frames */
+	std::chrono::steady_clock::duration getSamplePeriod() const {
+		return period;
+	}
+
+	/** Returns when a frame was sampled, assuming the last one was sampled
+	 * when the packet was received */
+	std::chrono::steady_clock::time_point getSampleTime(size_t frame) const {
+		return timestamp - period * (frames - 1 - frame);
+	}
+
+	/** Returns the channel of a single sensor bit, or -1 if it is not streamed */
+	int getChannelIndex(Macro::StreamingMasks sensor) const;
+
+	/** Returns the number of channels streamed with the given mask */
+	static size_t countChannels(int mask);
+
+	/** Returns the channel of a single sensor bit streamed with the given
+	 * mask, or -1 if it is not streamed */
+	static int getChannelIndex(int mask, int sensor);
+
+	/** Returns the sensor bit of a channel streamed with the given mask */
+	static int getChannelSensor(int mask, size_t channel);
 };
 
 struct IListener {
 	virtual ~IListener() {}
 	virtual void onPacketReceived(const Response::Message &message) = 0;
+
+	/** Called after onPacketReceived for DATA responses, with the decoded values */
+	virtual void onSensorData(const SensorData &/* data */) {}
+
+	/** Called after onPacketReceived for successful answers to VERSIONING */
+	virtual void onVersion(const Response::VersionView &/* version */) {}
+
+	/** Called after onPacketReceived for successful answers to GET_BLUETOOTH_INFO */
+	virtual void onBluetoothInfo(const Response::BluetoothInfoView &/* info */) {}
+
+	/** Called after onPacketReceived for configuration block contents */
+	virtual void onConfigurationBlock(const Response::ConfigurationBlockView &/* block */) {}
+
+	/** Called after onPacketReceived for level 1 diagnostics */
+	virtual void onDiagnostics(const Response::DiagnosticsView &/* diagnostics */) {}
+
+	/** Called when a command sent with sendReliable was given up */
+	virtual void onCommandFailed(const Command::Message &/* message */) {}
+};
+
+class Robot;
+class Fleet;
+class Simulation;
+
+/** Receives progress notifications while robots are being connected */
+struct IConnectionListener {
+	virtual ~IConnectionListener() {}
+
+	/** A connection attempt (starting with 1) has been started */
+	virtual void onConnecting(Robot &/* robot */, unsigned int /* attempt */) {}
+
+	/** The robot has been connected */
+	virtual void onConnected(Robot &/* robot */) {}
+
+	/** The last connection attempt has failed or timed out */
+	virtual void onConnectFailed(Robot &/* robot */) {}
+
+	/** The connection has been lost unexpectedly */
+	virtual void onDisconnected(Robot &/* robot */) {}
+
+	/** The connection has been recovered, and the state replayed */
+	virtual void onReconnected(Robot &/* robot */) {}
+};
+
+/** Options for connecting many robots at once */
+struct ConnectOptions {
+	/** Milliseconds before a single attempt is abandoned, or 0 to wait
+	 * forever as Robot::connect does */
+	unsigned int timeout;
+
+	/** Number of attempts per robot */
+	unsigned int attempts;
+
+	/** Maximum number of simultaneous attempts, or 0 for no limit */
+	unsigned int maxConcurrent;
+
+	ConnectOptions() :
+		timeout(5000), attempts(2), maxConcurrent(0) {
+	}
+};
+
+/** Controls how commands sent with Robot::sendReliable are retransmitted */
+struct RetryPolicy {
+	/** Retransmissions before the command is given up */
+	unsigned int attempts;
+
+	/** Milliseconds to wait for the first acknowledgement */
+	unsigned int timeout;
+
+	/** Longest wait, as it doubles with every retransmission */
+	unsigned int maxTimeout;
+
+	RetryPolicy() :
+		attempts(3), timeout(200), maxTimeout(1600) {
+	}
+};
+
+/** What a full send queue does with one more command */
+enum class OverflowPolicy {
+	/** The caller waits until the link takes a packet */
+	BLOCK,
+
+	/** The oldest packet not yet started is discarded */
+	DROP_OLDEST,
+
+	/** The new command is refused, and send() returns -1 */
+	REJECT
+};
+
+/** Controls the queue of packets the link has not taken yet */
+struct SendQueueOptions {
+	/** Whether packets are queued when the link is busy, instead of
+	 * blocking the caller until they are written */
+	bool enabled;
+
+	/** Packets that may wait in the queue, besides one partly written */
+	size_t capacity;
+
+	/** What happens to a command that finds the queue full */
+	OverflowPolicy overflow;
+
+	SendQueueOptions() :
+		enabled(false), capacity(64), overflow(OverflowPolicy::BLOCK) {
+	}
+};
+
+/** Controls how a robot recovers from a lost connection */
+struct ReconnectPolicy {
+	/** Whether lost connections are recovered at all */
+	bool enabled;
+
+	/** Number of attempts before giving up, or 0 to retry forever */
+	unsigned int attempts;
+
+	/** Milliseconds before a single attempt is abandoned, or 0 to wait forever */
+	unsigned int timeout;
+
+	/** Milliseconds to wait after the first failed attempt */
+	unsigned int initialDelay;
+
+	/** Upper bound for the delay, which doubles after every failed attempt */
+	unsigned int maxDelay;
+
+	ReconnectPolicy() :
+		enabled(false), attempts(0), timeout(2000),
+		initialDelay(100), maxDelay(2000) {
+	}
 };
 
 class Robot {
+	friend class Fleet;
+	friend class Simulation;
+
 private:
 	ByteArrayBuffer rxBuffer;
+	int wakeup;
+	std::atomic<bool> stopRequested;
 	std::string address;
 	RobotState state;
 	int socket;
-	unsigned int seqNum;
+	std::atomic<unsigned int> seqNum;
 	bool debug;
+	std::mutex sendMutex;
+	std::mutex listenerMutex;
+	std::vector<IListener*> listeners;
+	SensorData sensorData;
+	std::atomic<bool> connectionWanted;
+	ReconnectPolicy reconnectPolicy;
+	IConnectionListener *connectionListener;
+	Simulation *simulation;
+	std::atomic<int64_t> lastResponse;
+	std::atomic<Command::MessageType> requests[256];
+
+	/** A command sent with sendReliable, waiting to be acknowledged */
+	struct Unacknowledged {
+		Command::Message message;
+		RetryPolicy policy;
+		std::vector<int> seqNums;
+		unsigned int attempts;
+		unsigned int timeout;
+		std::chrono::steady_clock::time_point deadline;
+	};
+	std::vector<Unacknowledged> unacknowledged;
+
+	/** Packets waiting for the link, guarded by the send mutex. Only the
+	 * first one can be partly written, up to the offset. */
+	SendQueueOptions sendQueue;
+	std::deque<ByteArrayBuffer> txQueue;
+	size_t txOffset;
+	std::atomic<size_t> txQueued;
+	std::atomic<unsigned int> txDropped;
+
+	/** Guards the unacknowledged commands. It may be locked while holding
+	 * the send mutex, but not the other way round, so acknowledgements are
+	 * never held up by a blocked write. */
+	std::mutex retryMutex;
+
+	/** Guards the state against readers on other threads. Unlike the send
+	 * mutex, it is never held during a write, so listeners may take it. */
+	mutable std::mutex stateMutex;
+
+	/** The fleet whose arrays hold a copy of the state, and the robot's index */
+	Fleet *fleet;
+	size_t fleetIndex;
+
+	/** Copies the state into the fleet's arrays, if the robot is in a fleet */
+	void storeInFleet();
+
+	void updateInternalValues(Command::MessageType command, const uint8_t *values);
+
+	/** Starts a non-blocking connection, returning the pending socket or -1 */
+	int openSocket(const std::string &address);
+
+	/** Completes a connection started with openSocket. The robot is
+	 * either reset or, when restoring, given back its previous state. */
+	bool finishConnect(int fd, bool restore);
+
+	/** Waits for a connection started with openSocket */
+	bool waitConnect(int fd, unsigned int timeout);
+
+	/** Tries to recover a lost connection according to the policy */
+	bool reconnect();
+
+	/** Passes a received message to the listeners, after matching
+	 * regular responses to the commands they answer */
+	void dispatch(IListener &listener, Response::Message &message);
+
+	/** Handles a lost connection. Returns whether it was recovered. */
+	bool recover();
+
+	/** Interrupts a process() waiting for data */
+	void wake();
+
+	/** Writes a packet under the given sequence number, or queues it when
+	 * the link is busy. Returns the sequence number, or -1 if the queue
+	 * refused it. A full queue only blocks if allowed to. The send mutex
+	 * must be locked. */
+	int transmit(const Command::Message &message, int sequenceNumber, bool block = true);
+
+	/** Makes room in a full queue according to the overflow policy.
+	 * Returns whether one more packet can be queued. */
+	bool reserve(bool block);
+
+	/** Writes the bytes of a packet, queueing what the link does not take */
+	bool writePacket(const uint8_t *bytes, size_t length);
+
+	/** Writes as much of the queue as the link takes without blocking.
+	 * Returns false if the link failed, dropping the queue. */
+	bool flushQueue();
 
-	void updateInternalValues(const Command::Message &command);
+	/** Stops retransmitting older commands of the given type */
+	void supersede(Command::MessageType command);
+
+	/** Retransmits a command until the packet with the given sequence
+	 * number, or a retransmission, is acknowledged */
+	void track(const Command::Message &message, const RetryPolicy &policy,
+			int sequenceNumber);
+
+	/** Shortens a process() timeout to the next retransmission */
+	int getRetryTimeout(int timeout);
+
+	/** Matches a response to the command it acknowledges */
+	void acknowledge(IListener &listener, const Response::Message &message);
+
+	/** Retransmits the commands whose acknowledgement is overdue */
+	void retransmit(IListener &listener);
+
+	/** Returns the current time, which is virtual for emulated robots */
+	std::chrono::steady_clock::time_point getTime() const;
+
+	/** Tells the listeners that commands were given up */
+	void notifyFailed(IListener &listener, const std::vector<Command::Message> &failed);
 
 public:
 	Robot();
 	virtual ~Robot();
 
 	/** Connects to the given Bluetooth address. The address should be
-	 * in the form '00:06:66:XX:XX:XX' */
-	bool connect(const std::string &address);
+	 * in the form '00:06:66:XX:XX:XX'. The attempt is abandoned after
+	 * the given number of milliseconds, or never if the timeout is 0. */
+	bool connect(const std::string &address, unsigned int timeout = 0);
+
+	/** Uses an already connected stream socket instead of a Bluetooth
+	 * connection, for instance one end of a socketpair leading to an
+	 * emulated robot. The robot takes ownership of the socket. */
+	bool connectSocket(int fd, const std::string &name = "socket");
 
 	/** Closes the connection */
 	void disconnect();
 
-	/** Sends a direct command to the robot */
-	void send(const Command::Message &message);
+	/** Sends a direct command to the robot. Returns the sequence number
+	 * of the packet, which is repeated in the robot's response, or -1 if
+	 * the send queue is full and rejects it. */
+	int send(const Command::Message &message);
+
+	/** Sends a direct command under a sequence number handed out by
+	 * reserveSequenceNumber(). Returns it, or -1 if the queue rejects it. */
+	int send(const Command::Message &message, int sequenceNumber);
+
+	/** Hands out the sequence number of a later send, without waiting for
+	 * a blocked write. Listeners record the command under it before it is
+	 * sent, so the response cannot overtake the record. */
+	int reserveSequenceNumber();
+
+	/** Sets whether packets the link cannot take at once are queued.
+	 * Queued packets are written by listen() and process() as the link
+	 * drains, and by later sends. Disabling the queue writes it first. */
+	void setSendQueue(const SendQueueOptions &options);
+
+	/** Waits up to the given number of milliseconds (-1 for ever) for the
+	 * send queue to be written. Returns whether it is empty. */
+	bool flush(int timeout = -1);
+
+	/** Returns the number of packets waiting in the send queue */
+	size_t getQueuedPackets() const {
+		return txQueued;
+	}
+
+	/** Returns the number of packets the send queue discarded */
+	unsigned int getDroppedPackets() const {
+		return txDropped;
+	}
+
+	/** Sends a command that is retransmitted until the robot acknowledges it,
+	 * as long as the robot is listened to. Errors caused by the link and
+	 * missing responses lead to retransmissions, with a timeout that doubles
+	 * every time. The command is given up once the retries are used, or
+	 * when a newer command of the same type is sent. Returns the sequence
+	 * number of the first transmission, or -1 if the send queue rejects it. */
+	int sendReliable(const Command::Message &message,
+			const RetryPolicy &policy = RetryPolicy());
+
+	/** Returns the number of reliable commands not yet acknowledged */
+	size_t getUnacknowledged();
 
 	/** Listens for data coming from the robot, sending the received data to the listener.
-	 * This function will block indefinitely. */
+	 * This function blocks until stopListening() is called or the connection is lost. */
 	void listen(IListener &listener);
 
+	/** Waits up to the given number of milliseconds for data (-1 waits
+	 * forever, 0 not at all), and sends the packets it completes to the
+	 * listener. Returns the number of packets, or -1 if the connection is lost. */
+	int process(IListener &listener, int timeout = 0);
+
+	/** Makes listen() return. Can be called from any thread, or from a listener. */
+	void stopListening();
+
+	/** Returns the socket, so it can be polled by other event loops */
+	int getFileDescriptor() const {
+		return socket;
+	}
+
+	/** Adds a listener that receives every packet before the one given to
+	 * listen(). Listeners must not be added or removed from a callback. */
+	void addListener(IListener &listener);
+
+	/** Removes a listener added with addListener */
+	void removeListener(IListener &listener);
+
 	/** Sets whether incoming and outgoing data should be printed */
 	void setDebug(bool b);
 
+	/** Sets how listen() handles a lost connection. When enabled, it
+	 * reconnects and replays the last known state instead of returning. */
+	void setReconnectPolicy(const ReconnectPolicy &policy);
+
+	/** Sets the listener notified about connection changes, or 0 for none */
+	void setConnectionListener(IConnectionListener *listener);
+
+	/** Sends the commands needed to bring the robot back to the stored
+	 * state: LED colors, stabilization, motion and continuous streaming */
+	void restoreState();
+
 	/** Sends a roll command to the given heading (in degrees) and speed (0-255) */
 	void roll(int heading, uint8_t speed);
 
@@ -416,10 +1024,10 @@ public:
 	/** Sets the heading (in degrees) while maintaining the speed */
 	void setHeading(int heading);
 
-	/** Stops the motors */
+	/** Stops the motors. The command is sent reliably. */
 	void stop();
 
-	/** Calibrates the heading */
+	/** Calibrates the heading. The command is sent reliably. */
 	void calibrateHeading(int heading);
 
 	/** Sets the LED RGB color */
@@ -432,12 +1040,13 @@ public:
 	void enableStabilizer(bool on);
 
 	/** Convenience function, waits the given amount of milliseconds.
-	 * This function is not related to the SLEEP macro. */
+	 * This function is not related to the SLEEP macro. Emulated robots
+	 * run their simulation for the given time instead. */
 	void delay(unsigned int milliseconds);
 
-	/** Returns whether the socket is connected */
+	/** Returns whether the socket is connected, or the robot is emulated */
 	bool isConnected() const {
-		return socket != -1;
+		return socket != -1 || simulation != 0;
 	}
 
 	/** Returns information about the state stored from sent commands */
@@ -445,6 +1054,9 @@ public:
 		return state;
 	}
 
+	/** Returns a copy of the state, consistent even while other threads send */
+	RobotState copyState() const;
+
 	/** Returns the last heading sent */
 	int getHeading() const {
 		return state.heading;
@@ -485,6 +1097,1486 @@ public:
 		return address;
 	}
 
+	/** Returns when the last regular response was received, or the epoch
+	 * of the clock if none was */
+	std::chrono::steady_clock::time_point getLastResponseTime() const {
+		return std::chrono::steady_clock::time_point(
+				std::chrono::steady_clock::duration(lastResponse.load()));
+	}
+
+};
+
+/** Estimated quality of the link to a robot. Times are in milliseconds,
+ * and averages are exponentially weighted. */
+struct LinkQuality {
+	double rtt;
+	double jitter;
+	double loss;
+
+	/** One-way latency, estimated as half the fastest recent round trip */
+	double latency;
+
+	unsigned int sent;
+	unsigned int received;
+	unsigned int lost;
+};
+
+/** Receives notifications when the link quality crosses the thresholds */
+struct ILinkQualityListener {
+	virtual ~ILinkQualityListener() {}
+
+	/** The link has exceeded at least one of the thresholds */
+	virtual void onLinkDegraded(Robot &/* robot */, const LinkQuality &/* quality */) {}
+
+	/** The link is back within all thresholds */
+	virtual void onLinkRecovered(Robot &/* robot */, const LinkQuality &/* quality */) {}
+};
+
+/** Options for the heartbeat */
+struct HeartbeatOptions {
+	/** Milliseconds between pings */
+	unsigned int period;
+
+	/** Milliseconds before an unanswered ping counts as lost */
+	unsigned int timeout;
+
+	/** Weight of every new sample in the averages */
+	double gain;
+
+	/** Round trip time above which the link is degraded */
+	double maxRtt;
+
+	/** Jitter above which the link is degraded */
+	double maxJitter;
+
+	/** Loss ratio (0-1) above which the link is degraded */
+	double maxLoss;
+
+	/** Number of recent round trips the latency is estimated from */
+	unsigned int window;
+
+	HeartbeatOptions() :
+		period(250), timeout(1000), gain(0.125),
+		maxRtt(150), maxJitter(50), maxLoss(0.2), window(16) {
+	}
+};
+
+/** Pings a robot periodically from a background thread, estimating the
+ * quality of the link from the responses. The heartbeat registers itself
+ * as a listener, so the robot must be listening for the pings to arrive. */
+class Heartbeat : public IListener {
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Ping {
+		int seqNum;
+		Clock::time_point sent;
+	};
+
+	Robot &robot;
+	HeartbeatOptions options;
+	ILinkQualityListener *listener;
+	LinkQuality quality;
+	bool degraded;
+	bool running;
+	std::deque<Ping> pending;
+	std::deque<double> samples;
+	std::thread thread;
+	mutable std::mutex mutex;
+	std::condition_variable wakeup;
+
+	void run();
+	void update(std::unique_lock<std::mutex> &lock, double rtt, bool lost);
+
+public:
+	Heartbeat(Robot &robot,
+			const HeartbeatOptions &options = HeartbeatOptions(),
+			ILinkQualityListener *listener = 0);
+	virtual ~Heartbeat();
+
+	/** Starts pinging */
+	void start();
+
+	/** Stops pinging, waiting for the thread to finish */
+	void stop();
+
+	/** Returns the current estimate */
+	LinkQuality getQuality() const;
+
+	/** Returns whether the link currently exceeds a threshold */
+	bool isDegraded() const;
+
+	virtual void onPacketReceived(const Response::Message &message);
+};
+
+/** Firmware versions reported by the VERSIONING command */
+struct VersionInfo {
+	uint8_t record;
+	uint8_t model;
+	uint8_t hardware;
+	uint8_t mainApp;
+	uint8_t mainAppRevision;
+	uint8_t bootloader;
+	uint8_t basic;
+	uint8_t macro;
+	uint8_t apiMajor;
+	uint8_t apiMinor;
+};
+
+/** What is known about a robot, from its versioning and Bluetooth
+ * information responses */
+struct Capabilities {
+	bool hasVersion;
+	VersionInfo version;
+	bool hasBluetoothInfo;
+	std::string name;
+	std::string bluetoothAddress;
+
+	/** Time of the last update, in seconds since the epoch */
+	int64_t updated;
+
+	Capabilities();
+
+	/** Reads a versioning response. Returns whether it was complete. */
+	bool parseVersion(const Response::Message &message);
+
+	/** Reads a Bluetooth information response. Returns whether it was complete. */
+	bool parseBluetoothInfo(const Response::Message &message);
+
+	/** Returns whether both responses have been read */
+	bool isComplete() const {
+		return hasVersion && hasBluetoothInfo;
+	}
+
+	/** Returns whether the firmware implements at least the given API version */
+	bool supportsApi(uint8_t major, uint8_t minor) const {
+		return hasVersion && (version.apiMajor > major
+				|| (version.apiMajor == major && version.apiMinor >= minor));
+	}
+};
+
+/** Capabilities of robots, stored by Bluetooth address in a text file */
+class CapabilityCache {
+private:
+	std::string path;
+	std::vector<std::pair<std::string, Capabilities> > entries;
+	mutable std::mutex mutex;
+
+public:
+	/** Loads the cache from the given file, if it exists */
+	CapabilityCache(const std::string &path);
+	virtual ~CapabilityCache();
+
+	/** Looks up a robot. Returns whether it was found. */
+	bool get(const std::string &address, Capabilities &capabilities) const;
+
+	/** Stores the capabilities of a robot and saves the file */
+	bool put(const std::string &address, const Capabilities &capabilities);
+
+	/** Reads the file again, replacing the entries in memory */
+	bool load();
+
+	/** Writes the entries to the file, replacing it atomically */
+	bool save() const;
+};
+
+/** Finds out the capabilities of a robot. Cached capabilities are
+ * available at once; when missing or older than the given age, they are
+ * queried again and the responses are read by the robot's listen loop,
+ * so nobody waits for the round trips. */
+class CapabilityProbe : public IListener {
+private:
+	Robot &robot;
+	CapabilityCache &cache;
+	unsigned int maxAge;
+	Capabilities capabilities;
+	int versionSeqNum;
+	int bluetoothSeqNum;
+	mutable std::mutex mutex;
+	std::condition_variable changed;
+
+	void update(const Capabilities &updated);
+
+public:
+	/** Probes the given robot, refreshing cached entries older than the
+	 * given number of seconds */
+	CapabilityProbe(Robot &robot, CapabilityCache &cache,
+			unsigned int maxAge = 7 * 24 * 3600);
+	virtual ~CapabilityProbe();
+
+	/** Loads the cached capabilities of the connected robot, and sends the
+	 * queries if they are missing or stale. Returns whether the cached
+	 * capabilities could be used. */
+	bool start();
+
+	/** Sends the queries, even if the cached capabilities are fresh */
+	void refresh();
+
+	/** Returns the capabilities known so far */
+	Capabilities getCapabilities() const;
+
+	/** Waits up to the given number of milliseconds for both responses.
+	 * The robot must be listened to by another thread. */
+	bool waitForCapabilities(unsigned int timeout);
+
+	virtual void onPacketReceived(const Response::Message &message);
+};
+
+/** Which macros are stored under which IDs on which robots, saved by
+ * Bluetooth address in a text file. Macros are known by a hash of their
+ * content, together with the firmware they were uploaded to. */
+class MacroCache {
+private:
+	struct Entry {
+		std::string address;
+		uint8_t macroId;
+		uint64_t hash;
+		uint32_t firmware;
+	};
+
+	std::string path;
+	std::vector<Entry> entries;
+	mutable std::mutex mutex;
+
+public:
+	/** Loads the cache from the given file, if it exists */
+	MacroCache(const std::string &path);
+	virtual ~MacroCache();
+
+	/** Returns the 64 bit FNV-1a hash of a macro */
+	static uint64_t hash(const ByteArrayBuffer &macro);
+
+	/** Returns the firmware a macro is uploaded to, from the version of the
+	 * main application. Macros of other firmware are not trusted. */
+	static uint32_t getFirmware(const VersionInfo &version);
+
+	/** Returns whether a robot holds the macro with the given hash under
+	 * the given ID, as far as is known */
+	bool contains(const std::string &address, uint8_t macroId, uint64_t hash,
+			uint32_t firmware = 0) const;
+
+	/** Records the macro a robot holds under an ID, and saves the file */
+	bool put(const std::string &address, uint8_t macroId, uint64_t hash,
+			uint32_t firmware = 0);
+
+	/** Forgets the macro a robot holds under an ID, and saves the file */
+	bool remove(const std::string &address, uint8_t macroId);
+
+	/** Forgets every macro of a robot, as after it was reset */
+	bool clear(const std::string &address);
+
+	/** Reads the file again, replacing the entries in memory */
+	bool load();
+
+	/** Writes the entries to the file, replacing it atomically */
+	bool save() const;
+};
+
+/** Runs macros on a robot, uploading them only when the cache does not
+ * know them to be stored. A robot that was reset meanwhile answers the run
+ * with an error; the macro is then uploaded and run again. Uploads are
+ * recorded once the robot acknowledges them, and the responses are read
+ * by the robot's listen loop. The loader's own thread saves the cache and
+ * uploads lost macros, so the listen loop never waits for either. */
+class MacroLoader : public IListener {
+private:
+	/** A save or a run waiting for its response */
+	struct Pending {
+		int seqNum;
+		bool upload;
+		uint8_t macroId;
+		uint64_t hash;
+		ByteArrayBuffer macro;
+	};
+
+	/** A response left to the loader's thread */
+	struct Answer {
+		Pending command;
+		bool ok;
+	};
+
+	Robot &robot;
+	MacroCache &cache;
+	uint32_t firmware;
+	std::vector<Pending> pending;
+	std::deque<Answer> answers;
+	unsigned int uploads;
+	bool running;
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable wakeup;
+
+	/** Waits for the response to a command. The mutex must be locked. */
+	void record(const Pending &entry);
+
+	/** Stops waiting for a command that was not sent. The mutex must be locked. */
+	void forget(int seqNum);
+
+	/** Runs a macro, uploading it first if asked to. The run keeps the
+	 * macro if it is to be uploaded again when the robot has lost it. */
+	void start(uint8_t macroId, uint64_t hash, const ByteArrayBuffer &macro,
+			bool upload, bool retry);
+
+	/** Handles the answers until the loader is destroyed */
+	void work();
+
+public:
+	/** Runs macros on the given robot, with the firmware it runs if known */
+	MacroLoader(Robot &robot, MacroCache &cache, uint32_t firmware = 0);
+	virtual ~MacroLoader();
+
+	/** Runs the given macro, stored under the given ID. Returns whether
+	 * it had to be uploaded first. */
+	bool run(uint8_t macroId, const ByteArrayBuffer &macro);
+
+	/** Returns the number of macros uploaded so far */
+	unsigned int getUploads();
+
+	virtual void onPacketReceived(const Response::Message &message);
+};
+
+/** Timing information passed to every run of a periodic task */
+struct TickInfo {
+	/** Number of the run, starting with 0 */
+	uint64_t tick;
+
+	/** Time at which the run was due */
+	std::chrono::steady_clock::time_point deadline;
+
+	/** Time elapsed between the deadline and the start of the run */
+	std::chrono::steady_clock::duration lateness;
+
+	/** Periods skipped since the previous run because it overran */
+	unsigned int skipped;
+};
+
+/** A task run periodically by the scheduler */
+struct IPeriodicTask {
+	virtual ~IPeriodicTask() {}
+	virtual void onTick(const TickInfo &info) = 0;
+};
+
+/** Timing statistics of a periodic task */
+struct SchedulerStatistics {
+	/** Number of buckets in the lateness histogram */
+	static const int HISTOGRAM_SIZE = 16;
+
+	/** Number of runs */
+	uint64_t runs;
+
+	/** Runs that finished after the next deadline */
+	uint64_t overruns;
+
+	/** Periods skipped because of overruns */
+	uint64_t skipped;
+
+	/** Largest lateness seen, in microseconds */
+	double maxLateness;
+
+	/** Lateness histogram. Bucket 0 counts runs started less than 2 microseconds
+	 * late, bucket k those started between 2^k and 2^(k+1) microseconds late.
+	 * The last bucket also counts everything later. */
+	uint64_t lateness[HISTOGRAM_SIZE];
+};
+
+/** Runs tasks at fixed rates. Every deadline is computed from the first one,
+ * and the timer is armed with absolute times, so the rate does not drift
+ * no matter how long the tasks take. */
+class Scheduler {
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Entry {
+		IPeriodicTask *task;
+		Clock::duration period;
+		Clock::time_point start;
+		Clock::time_point next;
+		uint64_t tick;
+		SchedulerStatistics statistics;
+	};
+
+	std::vector<Entry> entries;
+	mutable std::mutex mutex;
+	int timer;
+	int event;
+	bool stopRequested;
+
+	Entry *findEntry(const IPeriodicTask &task);
+	void runEntry(std::unique_lock<std::mutex> &lock, Entry &entry,
+			Clock::time_point now);
+
+public:
+	Scheduler();
+	virtual ~Scheduler();
+
+	/** Adds a task run the given number of times per second. The first
+	 * run is due immediately. Rates that are not positive are refused. */
+	void add(IPeriodicTask &task, double rate);
+
+	/** Removes a task */
+	void remove(IPeriodicTask &task);
+
+	/** Runs the tasks until stop() is called. This function blocks, and
+	 * returns at once if stop() was called since the last run. */
+	void run();
+
+	/** Makes run() return. Can be called from a task or from another thread. */
+	void stop();
+
+	/** Returns the timing statistics of a task */
+	SchedulerStatistics getStatistics(const IPeriodicTask &task) const;
+};
+
+/** A point of a path, to be reached the given number of seconds after the start */
+struct Waypoint {
+	double time;
+	double x;
+	double y;
+};
+
+/** Supplies the waypoints of a path in increasing time, one at a time */
+struct IWaypointSource {
+	virtual ~IWaypointSource() {}
+
+	/** Stores the next waypoint, returning false once the path is over */
+	virtual bool next(Waypoint &waypoint) = 0;
+};
+
+/** Waypoint source reading from a list */
+class WaypointList : public IWaypointSource {
+private:
+	std::vector<Waypoint> waypoints;
+	size_t index;
+
+public:
+	WaypointList(const std::vector<Waypoint> &waypoints = std::vector<Waypoint>());
+
+	/** Adds a waypoint at the end of the path */
+	void add(double time, double x, double y);
+
+	virtual bool next(Waypoint &waypoint);
+};
+
+/** Options for following a trajectory */
+struct TrajectoryOptions {
+	/** Seconds ahead on the path that the robot is steered towards. It
+	 * must be positive, or the default is used. */
+	double lookahead;
+
+	/** Speed (0-255) corresponding to one distance unit per second */
+	double speedScale;
+
+	/** Upper bound for the speed */
+	uint8_t maxSpeed;
+
+	/** Whether the path is interpolated with splines instead of lines */
+	bool spline;
+
+	/** Heading change (in degrees) below which no command is sent */
+	int headingDeadband;
+
+	/** Speed change below which no command is sent */
+	int speedDeadband;
+
+	TrajectoryOptions() :
+		lookahead(0.2), speedScale(1), maxSpeed(255), spline(true),
+		headingDeadband(2), speedDeadband(2) {
+	}
+};
+
+/** Turns a time-parameterized path into roll commands. The path is
+ * interpolated as it is followed, keeping only the waypoints around the
+ * current time, so it can be arbitrarily long. The follower is meant to be
+ * run by a Scheduler, whose rate determines how often commands are sent. */
+class TrajectoryFollower : public IPeriodicTask {
+private:
+	Robot &robot;
+	IWaypointSource &source;
+	TrajectoryOptions options;
+	std::deque<Waypoint> window;
+	std::chrono::steady_clock::time_point start;
+	bool started;
+	bool exhausted;
+	std::atomic<bool> finished;
+	bool sent;
+	int lastHeading;
+	int lastSpeed;
+
+	bool fill(double time);
+	void interpolate(double time, double &x, double &y) const;
+
+public:
+	TrajectoryFollower(Robot &robot, IWaypointSource &source,
+			const TrajectoryOptions &options = TrajectoryOptions());
+	virtual ~TrajectoryFollower();
+
+	/** Returns whether the end of the path has been reached */
+	bool isFinished() const {
+		return finished;
+	}
+
+	virtual void onTick(const TickInfo &info);
+};
+
+/** A single frame of sensor values, as published in shared memory */
+struct TelemetryFrame {
+	static const int MAX_CHANNELS = 32;
+
+	/** Sampling time, in nanoseconds of the monotonic clock */
+	int64_t timestamp;
+
+	/** Streaming mask the values were decoded with */
+	int32_t mask;
+
+	/** Number of values */
+	uint32_t channels;
+
+	int16_t values[MAX_CHANNELS];
+};
+
+/** Publishes the decoded sensor frames and the state of a robot in a POSIX
+ * shared memory segment. Frames go into a ring, and both the ring slots and
+ * the state are guarded by sequence locks, so readers in other processes
+ * never block the publisher. The publisher registers itself as a listener
+ * of the robot. */
+class TelemetryPublisher : public IListener {
+private:
+	Robot &robot;
+	std::string name;
+	void *memory;
+	size_t size;
+
+public:
+	/** Creates the segment with the given name (like '/sphero-1') and room
+	 * for the given number of frames */
+	TelemetryPublisher(Robot &robot, const std::string &name, uint32_t capacity = 1024);
+	virtual ~TelemetryPublisher();
+
+	/** Returns whether the segment could be created */
+	bool isOpen() const {
+		return memory != 0;
+	}
+
+	/** Publishes the current robot state. This also happens with every packet. */
+	void publishState();
+
+	virtual void onPacketReceived(const Response::Message &message);
+	virtual void onSensorData(const SensorData &data);
+};
+
+/** Reads what a TelemetryPublisher publishes, possibly from another process.
+ * Reads never block the publisher; they are retried if the publisher
+ * changed the data meanwhile. */
+class TelemetryReader {
+private:
+	void *memory;
+	size_t size;
+
+public:
+	/** Opens the segment with the given name */
+	TelemetryReader(const std::string &name);
+	virtual ~TelemetryReader();
+
+	/** Returns whether the segment could be opened */
+	bool isOpen() const {
+		return memory != 0;
+	}
+
+	/** Returns the number of frames published so far */
+	uint64_t getFrameCount() const;
+
+	/** Reads the frame with the given number. Returns false if it has not
+	 * been published yet, or has already been overwritten. */
+	bool readFrame(uint64_t index, TelemetryFrame &frame) const;
+
+	/** Reads the latest frame. Returns false if there is none yet. */
+	bool readLatestFrame(TelemetryFrame &frame) const;
+
+	/** Reads the latest published robot state, and the time it was published */
+	bool readState(RobotState &state, int64_t *timestamp = 0) const;
+};
+
+/** A value of a sensor, and when it was sampled */
+struct SensorSample {
+	std::chrono::steady_clock::time_point time;
+	int16_t value;
+};
+
+/** Aggregates of a sensor over a span of time */
+struct SensorAggregate {
+	size_t count;
+	int16_t min;
+	int16_t max;
+	double mean;
+};
+
+/** Keeps the most recent sensor values, indexed by sampling time. Samples
+ * are found by binary search, and every channel keeps a segment tree, so
+ * the minimum, maximum and mean of any time span are answered in
+ * logarithmic time without rescanning. Once full, the oldest samples are
+ * replaced. A change of the streaming mask clears the history. */
+class SensorHistory : public IListener {
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Node {
+		int16_t min;
+		int16_t max;
+		int64_t sum;
+	};
+
+	size_t capacity;
+	int mask;
+	size_t channels;
+	uint64_t count;
+	std::vector<Clock::time_point> times;
+	std::vector<Node> trees;
+	mutable std::mutex mutex;
+
+	uint64_t lowerBound(Clock::time_point time) const;
+	void store(size_t channel, size_t position, int16_t value);
+	Node query(size_t channel, size_t begin, size_t end) const;
+
+public:
+	/** Creates a history with room for the given number of frames,
+	 * rounded up to a power of two */
+	SensorHistory(size_t capacity = 4096);
+	virtual ~SensorHistory();
+
+	/** Removes every sample */
+	void clear();
+
+	/** Returns the number of frames stored */
+	size_t size() const;
+
+	/** Computes the aggregates of a sensor over the samples taken in [from, to).
+	 * Returns false if the sensor is not streamed or there are no samples. */
+	bool getAggregate(Macro::StreamingMasks sensor,
+			Clock::time_point from,
+			Clock::time_point to,
+			SensorAggregate &aggregate) const;
+
+	/** Computes the aggregates of a sensor over the given span of time,
+	 * ending with the latest sample */
+	bool getAggregate(Macro::StreamingMasks sensor,
+			Clock::duration span,
+			SensorAggregate &aggregate) const;
+
+	/** Appends the samples of a sensor taken in [from, to) to the given list.
+	 * Returns the number of samples appended. */
+	size_t getSamples(Macro::StreamingMasks sensor,
+			Clock::time_point from,
+			Clock::time_point to,
+			std::vector<SensorSample> &samples) const;
+
+	virtual void onPacketReceived(const Response::Message &message);
+	virtual void onSensorData(const SensorData &data);
+};
+
+/** Writes decoded sensor data into a chunked, columnar binary file. Every
+ * chunk holds the sampling times and then the values of one channel after
+ * the other, preceded by a header with the minimum and maximum of every
+ * channel. Only one chunk is kept in memory, and chunks are written whole,
+ * so the file can be read with SensorArchive while it is being exported. */
+class SensorExporter : public IListener {
+private:
+	FILE *file;
+	size_t chunkFrames;
+	int mask;
+	size_t channels;
+	size_t frames;
+	std::vector<int64_t> times;
+	std::vector<int16_t> values;
+	ByteArrayBuffer chunk;
+
+public:
+	/** Creates the file. Chunks are written every time the given number
+	 * of frames is collected, or when the streaming mask changes. */
+	SensorExporter(const std::string &path, size_t chunkFrames = 4096);
+	virtual ~SensorExporter();
+
+	/** Returns whether the file could be created */
+	bool isOpen() const {
+		return file != 0;
+	}
+
+	/** Writes the frames collected so far as a chunk */
+	void flush();
+
+	virtual void onPacketReceived(const Response::Message &message);
+	virtual void onSensorData(const SensorData &data);
+};
+
+/** A chunk of an exported file. The pointers refer to the mapped file. */
+struct SensorChunk {
+	int mask;
+	size_t channels;
+	size_t frames;
+
+	/** Sampling times of the frames, in nanoseconds of the monotonic clock */
+	const int64_t *times;
+
+	/** Values, channel after channel */
+	const int16_t *values;
+
+	/** Minimum and maximum of every channel, interleaved */
+	const int16_t *limits;
+
+	/** Returns the values of a channel, one per frame */
+	const int16_t *getChannel(size_t channel) const {
+		return values + channel * frames;
+	}
+
+	/** Returns the smallest value of a channel */
+	int16_t getMin(size_t channel) const {
+		return limits[channel * 2];
+	}
+
+	/** Returns the largest value of a channel */
+	int16_t getMax(size_t channel) const {
+		return limits[channel * 2 + 1];
+	}
+};
+
+/** Reads a file written by SensorExporter by mapping it into memory */
+class SensorArchive {
+private:
+	int fd;
+	void *memory;
+	size_t size;
+	int64_t clockOffset;
+	std::vector<SensorChunk> chunks;
+
+public:
+	/** Opens the file */
+	SensorArchive(const std::string &path);
+	virtual ~SensorArchive();
+
+	/** Returns whether the file could be opened */
+	bool isOpen() const {
+		return memory != 0;
+	}
+
+	/** Maps the chunks written since the file was opened. Returns the
+	 * number of chunks. */
+	size_t refresh();
+
+	/** Returns the number of chunks */
+	size_t getChunkCount() const {
+		return chunks.size();
+	}
+
+	/** Returns a chunk */
+	const SensorChunk &getChunk(size_t index) const {
+		return chunks[index];
+	}
+
+	/** Returns the nanoseconds to add to the times to get Unix time */
+	int64_t getClockOffset() const {
+		return clockOffset;
+	}
+};
+
+/** A frame of sensor values coming out of a SensorMerger */
+struct MergedFrame {
+	static const int MAX_CHANNELS = 32;
+
+	/** Input the frame came from, as returned by SensorMerger::addInput */
+	size_t input;
+
+	/** Sampling time */
+	std::chrono::steady_clock::time_point time;
+
+	/** Streaming mask the values were decoded with */
+	int mask;
+
+	/** Number of values */
+	size_t channels;
+
+	int16_t values[MAX_CHANNELS];
+};
+
+/** Receives the frames of a SensorMerger, in order of sampling time */
+struct IMergeListener {
+	virtual ~IMergeListener() {}
+	virtual void onMergedFrame(const MergedFrame &frame) = 0;
+};
+
+/** Options for merging sensor streams */
+struct MergeOptions {
+	/** Milliseconds the merger waits for an input that has fallen silent,
+	 * behind the newest frame of any input, before leaving it behind */
+	unsigned int lateness;
+
+	/** Frames held back per input. An input that fills up forces the
+	 * oldest frames out, even if others are still being waited for. */
+	size_t capacity;
+
+	MergeOptions() :
+		lateness(50), capacity(256) {
+	}
+};
+
+/** Merges the decoded sensor data of many inputs into one sequence of
+ * frames, ordered by sampling time. The inputs are kept in a heap keyed by
+ * the time of their oldest frame, so every frame costs logarithmic time in
+ * the number of inputs. An input without frames is keyed by its latest
+ * frame instead, and holds back the others until it sends more or falls
+ * more than the lateness behind. Frames that arrive after newer ones of
+ * other inputs have been passed on are dropped as late. The listener is
+ * called from the thread that pushed the frame, with the merger locked.
+ * The merger can be run periodically by a Scheduler, so inputs that fall
+ * silent are left behind even when no other data arrives. */
+class SensorMerger : public IPeriodicTask {
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	/** Registered with a robot, to push its data into the merger */
+	struct Source : public IListener {
+		SensorMerger *merger;
+		Robot *robot;
+		size_t input;
+
+		virtual void onPacketReceived(const Response::Message &message);
+		virtual void onSensorData(const SensorData &data);
+	};
+
+	/** Frames of an input waiting to be merged, in a ring */
+	struct Queue {
+		std::vector<MergedFrame> frames;
+		size_t head;
+		size_t size;
+		Clock::time_point latest;
+
+		/** Place in the heap, or -1 if the input has been left behind */
+		int position;
+	};
+
+	IMergeListener &listener;
+	MergeOptions options;
+	std::vector<Source*> sources;
+	std::vector<Queue> queues;
+	std::vector<size_t> heap;
+	Clock::time_point newest;
+	Clock::time_point watermark;
+	uint64_t lateFrames;
+	mutable std::mutex mutex;
+
+	Clock::time_point getKey(size_t input) const;
+	bool isBefore(size_t a, size_t b) const;
+	void place(size_t index, size_t input);
+	void siftUp(size_t index);
+	void siftDown(size_t index);
+	void insert(size_t input);
+	void removeTop();
+	bool releaseTop(Clock::time_point limit);
+
+public:
+	/** Creates a merger passing the frames to the given listener */
+	SensorMerger(IMergeListener &listener, const MergeOptions &options = MergeOptions());
+	virtual ~SensorMerger();
+
+	/** Adds the data streamed by a robot as an input, and returns its index.
+	 * The merger registers itself as a listener of the robot. Inputs must
+	 * be added before the data arrives. */
+	size_t addInput(Robot &robot);
+
+	/** Adds an input fed with push(), and returns its index */
+	size_t addInput();
+
+	/** Adds the frames of the decoded data to an input. Frames older than
+	 * the previous one of the same input are given its time. */
+	void push(size_t input, const SensorData &data);
+
+	/** Passes on the frames of inputs left behind at the given time, that
+	 * is, the frames up to the lateness before it */
+	void advance(Clock::time_point now);
+
+	/** Passes on every frame held back */
+	void flush();
+
+	/** Returns the sampling time of the last frame passed on */
+	Clock::time_point getWatermark() const;
+
+	/** Returns the number of frames held back */
+	size_t getPendingFrames() const;
+
+	/** Returns the number of frames dropped because they arrived too late */
+	uint64_t getLateFrames() const;
+
+	virtual void onTick(const TickInfo &info);
+};
+
+/** Filtered frames of a packet. The values are stored frame after frame,
+ * and refer to the filter, so they are only valid during the callback. */
+class FilteredData {
+	friend class SensorFilter;
+
+private:
+	int mask;
+	size_t channels;
+	size_t frames;
+	const float *values;
+	const std::chrono::steady_clock::time_point *times;
+
+public:
+	/** Returns the mask the values were decoded with */
+	int getMask() const {
+		return mask;
+	}
+
+	/** Returns the number of channels */
+	size_t getChannelCount() const {
+		return channels;
+	}
+
+	/** Returns the number of frames left after decimation */
+	size_t getFrameCount() const {
+		return frames;
+	}
+
+	/** Returns the values of a frame, one per channel */
+	const float *getFrame(size_t frame) const {
+		return values + frame * channels;
+	}
+
+	/** Returns the value of a channel in the given frame */
+	float getValue(size_t channel, size_t frame) const {
+		return values[frame * channels + channel];
+	}
+
+	/** Returns when a frame was sampled */
+	std::chrono::steady_clock::time_point getSampleTime(size_t frame) const {
+		return times[frame];
+	}
+};
+
+/** A threshold crossed by a filtered channel */
+struct ThresholdCrossing {
+	/** Sensor bit of the channel */
+	int sensor;
+
+	/** Sampling time of the first frame beyond the threshold */
+	std::chrono::steady_clock::time_point time;
+
+	/** Filtered value in that frame */
+	float value;
+
+	/** Whether the value rose above the threshold, rather than fell below */
+	bool rising;
+};
+
+/** Receives the output of a SensorFilter */
+struct IFilterListener {
+	virtual ~IFilterListener() {}
+
+	/** Called with the filtered frames of every packet */
+	virtual void onFilteredData(const FilteredData &/* data */) {}
+
+	/** Called when a filtered channel crosses one of the thresholds */
+	virtual void onThresholdCrossed(const ThresholdCrossing &/* crossing */) {}
+};
+
+/** Runs the decoded sensor data through a chain of filters, applied to
+ * every channel in the order they were added, and watches the result for
+ * threshold crossings. Frames are processed one after the other with the
+ * channels side by side, so the compiler can run the channels of a frame
+ * in SIMD lanes. The filter state persists across packets, and nothing is
+ * allocated unless the streaming mask or rate changes, which also resets
+ * the state. Stages are added before the data arrives. */
+class SensorFilter : public IListener {
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	enum StageType {
+		BIQUAD, DERIVATIVE, FIR, DECIMATION
+	};
+
+	struct Stage {
+		StageType type;
+		bool highPass;
+		double cutoff;
+		unsigned int factor;
+		std::vector<float> taps;
+
+		/** Biquad coefficients b0, b1, b2, a1 and a2, or the rate for derivatives */
+		float coefficients[5];
+
+		/** Offset of the per-channel state, in values */
+		size_t state;
+		size_t position;
+		bool primed;
+	};
+
+	struct Threshold {
+		int sensor;
+		float level;
+		float hysteresis;
+		int channel;
+		int side;
+	};
+
+	IFilterListener &listener;
+	std::vector<Stage> stages;
+	std::vector<Threshold> thresholds;
+	int mask;
+	size_t channels;
+	Clock::duration period;
+	std::vector<float> state;
+	std::vector<float> work;
+	std::vector<Clock::time_point> times;
+	FilteredData output;
+
+	void configure(const SensorData &data);
+	size_t runStage(Stage &stage, size_t frames);
+	void detectCrossings(size_t frames);
+
+public:
+	/** Creates a filter passing its output to the given listener */
+	SensorFilter(IFilterListener &listener);
+	virtual ~SensorFilter();
+
+	/** Adds a second order Butterworth low-pass filter with the given
+	 * cutoff, in Hz */
+	void addLowPass(double cutoff);
+
+	/** Adds a second order Butterworth high-pass filter with the given
+	 * cutoff, in Hz */
+	void addHighPass(double cutoff);
+
+	/** Adds a stage computing the change per second between frames */
+	void addDerivative();
+
+	/** Adds a FIR filter with the given taps, the first one applied to
+	 * the newest frame */
+	void addFIR(const std::vector<float> &taps);
+
+	/** Adds a stage keeping one of every given number of frames. Later
+	 * stages run at the lower rate. */
+	void addDecimation(unsigned int factor);
+
+	/** Watches the filtered values of a sensor for crossings of the given
+	 * level. Values rise above the level when they reach it, but only fall
+	 * below it once they are lower by the hysteresis, so noise around the
+	 * level is not reported as many crossings. */
+	void addThreshold(Macro::StreamingMasks sensor, float level, float hysteresis = 0);
+
+	/** Clears the state of every stage, as after a gap in the data */
+	void reset();
+
+	/** Filters the decoded data of a packet */
+	void process(const SensorData &data);
+
+	virtual void onPacketReceived(const Response::Message &message);
+	virtual void onSensorData(const SensorData &data);
+};
+
+/** Bounds within which the sensor streaming is adapted */
+struct StreamingBounds {
+	/** Sensors to stream */
+	int mask;
+
+	/** Smallest divisor, that is, highest sampling rate allowed */
+	uint16_t minDivisor;
+
+	/** Largest divisor, that is, lowest sampling rate allowed */
+	uint16_t maxDivisor;
+
+	/** Fewest frames per packet allowed */
+	uint16_t minFrames;
+
+	/** Most frames per packet allowed */
+	uint16_t maxFrames;
+
+	/** Round trip time (in milliseconds) above which the link is considered saturated */
+	double maxLatency;
+
+	/** Deviation of the packet gaps, relative to the expected gap, above
+	 * which the link is considered saturated */
+	double maxGapDeviation;
+
+	/** Milliseconds between adjustments */
+	unsigned int interval;
+
+	StreamingBounds() :
+		mask(Macro::OFF), minDivisor(1), maxDivisor(40), minFrames(1), maxFrames(10),
+		maxLatency(100), maxGapDeviation(0.5), interval(1000) {
+	}
+};
+
+/** A streaming configuration and what was measured with it */
+struct StreamingPoint {
+	uint16_t divisor;
+	uint16_t frames;
+
+	/** Packets per second expected with this configuration */
+	double expectedRate;
+
+	/** Packets per second received */
+	double packetRate;
+
+	/** Bytes per second received */
+	double throughput;
+
+	/** Standard deviation of the packet gaps, relative to the expected gap */
+	double gapDeviation;
+
+	/** Round trip time in milliseconds, or 0 if unknown */
+	double latency;
+};
+
+/** Receives notifications when the streaming is reconfigured. The point
+ * holds the new configuration, and the measurements that led to it. */
+struct IStreamingListener {
+	virtual ~IStreamingListener() {}
+	virtual void onStreamingChanged(Robot &robot, const StreamingPoint &point) = 0;
+};
+
+/** Adapts the streaming rate and batching to what the link sustains. While
+ * the link keeps up, the sampling rate is raised first, and then the frames
+ * per packet are lowered. When packets arrive late or irregularly, or
+ * commands take too long to be acknowledged, frames are batched first, and
+ * then the rate is lowered. The controller listens to the robot, and is
+ * meant to be run periodically by a Scheduler. */
+class StreamingController : public IListener, public IPeriodicTask {
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	Robot &robot;
+	StreamingBounds bounds;
+	Heartbeat *heartbeat;
+	IStreamingListener *listener;
+	StreamingPoint point;
+	bool running;
+	unsigned int healthy;
+	Clock::time_point windowStart;
+	Clock::time_point lastPacket;
+	size_t packets;
+	size_t bytes;
+	double gapSum;
+	double gapSquares;
+	size_t gaps;
+
+	/** Guards the measurements, which the listener updates. It is never
+	 * held while sending, so a blocked write cannot hold up the listener. */
+	mutable std::mutex mutex;
+
+	/** Keeps the commands of start(), stop() and onTick() in order */
+	std::mutex commandMutex;
+
+	/** Starts measuring the operating point. Returns the command that
+	 * configures it, to be sent once the mutex is unlocked. */
+	Command::Message apply();
+	void resetWindow(Clock::time_point now);
+
+public:
+	/** Creates a controller. The optional heartbeat provides the latency. */
+	StreamingController(Robot &robot, const StreamingBounds &bounds,
+			Heartbeat *heartbeat = 0, IStreamingListener *listener = 0);
+	virtual ~StreamingController();
+
+	/** Starts streaming at the lowest rate and batching allowed */
+	void start();
+
+	/** Stops streaming */
+	void stop();
+
+	/** Returns the current configuration and measurements */
+	StreamingPoint getOperatingPoint() const;
+
+	virtual void onPacketReceived(const Response::Message &message);
+	virtual void onSensorData(const SensorData &data);
+	virtual void onTick(const TickInfo &info);
+};
+
+/** Group of robots that can be commanded at once. The fleet does not own
+ * the robots. The state of the robots is kept in one array per field, so
+ * fleet-wide queries and updates run over contiguous memory instead of
+ * visiting every robot. The robots write their entries as they send
+ * commands, receive responses and connect, so the arrays are always
+ * current and need no refreshing. */
+class Fleet {
+	friend class Robot;
+
+private:
+	std::vector<Robot*> robots;
+	std::vector<const Heartbeat*> heartbeats;
+	ByteArrayBuffer images;
+	std::vector<size_t> offsets;
+	unsigned int sendTimeout;
+
+	std::vector<int16_t> headings;
+	std::vector<uint8_t> velocities;
+	std::vector<uint8_t> reds;
+	std::vector<uint8_t> greens;
+	std::vector<uint8_t> blues;
+	std::vector<uint8_t> stopped;
+	std::vector<uint8_t> connected;
+	std::vector<int64_t> lastResponses;
+
+	/** Copies the state of a robot into the arrays. The state mutex of the
+	 * robot must be locked. */
+	void store(size_t index);
+
+	/** Builds one packet per robot from the message, and lets the given
+	 * function change the payload of each. With a retry policy, every
+	 * robot retransmits its packet until it is acknowledged. */
+	template<typename Patch>
+	size_t transmit(const Command::Message &message, Patch patch,
+			const RetryPolicy *policy = 0);
+
+	size_t transmit(const Command::Message &message, size_t length,
+			const RetryPolicy *policy);
+
+	/** Gives up the writes still pending when a broadcast times out,
+	 * leaving the rest of the packets to the robots' queues */
+	void abandon(const std::vector<size_t> &indices, size_t length);
+
+public:
+	Fleet();
+	virtual ~Fleet();
+
+	/** Adds a robot to the fleet, removing it from any other fleet. Robots
+	 * must not be added or removed while they send or receive packets. */
+	void add(Robot &robot);
+
+	/** Removes a robot from the fleet */
+	void remove(Robot &robot);
+
+	/** Connects the robots in parallel, the i-th robot to the i-th address.
+	 * Robots that are already connected are skipped. Returns the number of
+	 * connected robots once every attempt has finished. */
+	size_t connect(const std::vector<std::string> &addresses,
+			const ConnectOptions &options = ConnectOptions(),
+			IConnectionListener *listener = 0);
+
+	/** Returns the number of robots in the fleet */
+	size_t size() const {
+		return robots.size();
+	}
+
+	/** Returns the robot at the given index */
+	Robot &operator[](size_t index) {
+		return *robots[index];
+	}
+
+	/** Sends the same command to every connected robot. The packet is built
+	 * only once, and written to all sockets in a single pass. Robots whose
+	 * send queue is full are skipped rather than waited for, whatever
+	 * their overflow policy. Returns the number of robots that received
+	 * or queued the whole packet. */
+	size_t broadcast(const Command::Message &message);
+
+	/** Sets how many milliseconds a broadcast waits for slow links. Robots
+	 * whose links have not taken the packet by then are not counted as
+	 * delivered, and the rest of the packet is written by the robot's
+	 * listener. Such robots are skipped until it is. */
+	void setSendTimeout(unsigned int milliseconds) {
+		sendTimeout = milliseconds;
+	}
+
+	/** Sets the LED RGB color of every robot */
+	size_t setLEDColor(uint8_t red, uint8_t green, uint8_t blue);
+
+	/** Stops the motors of every robot, keeping their headings. As with
+	 * Robot::stop, the command is sent reliably. */
+	size_t stop(const RetryPolicy &policy = RetryPolicy());
+
+	/** Sets the heartbeat that estimates the latency of a robot, or 0 for none */
+	void setHeartbeat(Robot &robot, const Heartbeat *heartbeat);
+
+	/** Returns the last heading sent to each robot */
+	const int16_t *getHeadings() const {
+		return headings.empty() ? 0 : &headings[0];
+	}
+
+	/** Returns the last speed sent to each robot */
+	const uint8_t *getVelocities() const {
+		return velocities.empty() ? 0 : &velocities[0];
+	}
+
+	/** Returns the last red color sent to each robot */
+	const uint8_t *getReds() const {
+		return reds.empty() ? 0 : &reds[0];
+	}
+
+	/** Returns the last green color sent to each robot */
+	const uint8_t *getGreens() const {
+		return greens.empty() ? 0 : &greens[0];
+	}
+
+	/** Returns the last blue color sent to each robot */
+	const uint8_t *getBlues() const {
+		return blues.empty() ? 0 : &blues[0];
+	}
+
+	/** Returns, for each robot, 1 if a stop command was sent and 0 otherwise */
+	const uint8_t *getStopped() const {
+		return stopped.empty() ? 0 : &stopped[0];
+	}
+
+	/** Returns, for each robot, 1 if it is connected and 0 otherwise */
+	const uint8_t *getConnected() const {
+		return connected.empty() ? 0 : &connected[0];
+	}
+
+	/** Returns when each robot last responded, in nanoseconds of the
+	 * monotonic clock, or 0 if it never did */
+	const int64_t *getLastResponses() const {
+		return lastResponses.empty() ? 0 : &lastResponses[0];
+	}
+
+	/** Rolls every robot with its own heading (in degrees) and speed (0-255) */
+	size_t roll(const int *headings, const uint8_t *speeds);
+
+	/** Sets the heading (in degrees) of every robot, keeping its speed */
+	size_t setHeadings(const int *headings);
+
+	/** Sets the LED RGB color of every robot to its own color */
+	size_t setLEDColors(const uint8_t *red, const uint8_t *green, const uint8_t *blue);
+
+	/** Sends a command so that it reaches every connected robot at the given
+	 * time. Each send is moved earlier by the latency estimated by the robot's
+	 * heartbeat, so the call blocks until the last send. Returns the number
+	 * of robots the command was sent to. */
+	size_t sendAt(const Command::Message &message,
+			std::chrono::steady_clock::time_point when);
+};
+
+/** Behavior of an emulated robot and its link. Times are in milliseconds. */
+struct EmulationOptions {
+	/** One-way latency of the link */
+	double latency;
+
+	/** Largest random delay added to the latency */
+	double jitter;
+
+	/** Bytes per second carried in each direction */
+	double bandwidth;
+
+	/** Probability (0-1) that a command is lost, and never answered */
+	double loss;
+
+	EmulationOptions() :
+		latency(15), jitter(5), bandwidth(11520), loss(0) {
+	}
+};
+
+/** Discrete-event simulation with a virtual clock. Emulated robots answer
+ * every command and stream sensor data like real ones, but the packets are
+ * events that reach the robots' listeners when the virtual time gets there.
+ * Nothing waits for real time, so large fleets can be run for hours of
+ * virtual time in seconds. A simulation is not thread-safe, and must be
+ * driven from a single thread, either directly or through Robot::delay.
+ * Commands sent with sendReliable are retransmitted on the virtual clock,
+ * but Heartbeat and Scheduler wait for real time, so with emulated robots
+ * their work should be scheduled on the simulation instead. */
+class Simulation {
+	friend class Robot;
+	friend class Fleet;
+
+public:
+	typedef std::chrono::steady_clock Clock;
+
+private:
+	/** Queued event. The actions are kept apart, so reordering the queue
+	 * only moves these small records. */
+	struct Event {
+		Clock::time_point when;
+		uint64_t order;
+		size_t action;
+
+		bool operator<(const Event &other) const {
+			return when != other.when ? when > other.when : order > other.order;
+		}
+	};
+
+	/** One direction of a link, which carries packets one after the other */
+	struct Link {
+		Clock::time_point free;
+		Clock::time_point arrival;
+	};
+
+	struct Emulation {
+		uint64_t id;
+		EmulationOptions options;
+		IListener *listener;
+		Link uplink;
+		Link downlink;
+		unsigned int stream;
+		int16_t counter;
+	};
+
+	Clock::time_point time;
+	std::vector<Event> events;
+	std::vector<std::function<void()> > actions;
+	std::vector<size_t> freeActions;
+	uint64_t scheduled;
+	uint64_t processed;
+	uint64_t random;
+	uint64_t emulations;
+	std::unordered_map<Robot*, Emulation> robots;
+
+	double uniform();
+	Emulation *find(Robot *robot, uint64_t id);
+	Clock::time_point carry(Link &link, const EmulationOptions &options,
+			Clock::time_point start, size_t bytes);
+	void transmit(Robot &robot, const uint8_t *packet, size_t length);
+	void execute(Robot *robot, uint64_t id, const ByteArrayBuffer &packet);
+	void stream(Robot *robot, uint64_t id, unsigned int number,
+			uint16_t divisor, uint16_t frames, int mask, unsigned int remaining);
+	void deliver(Robot *robot, uint64_t id, const ByteArrayBuffer &packet);
+
+	/** Lets the robot retransmit its overdue commands at the given time */
+	void retryAt(Robot &robot, Clock::time_point when);
+	void retry(Robot *robot, uint64_t id);
+
+public:
+	/** Creates a simulation whose random delays and losses are derived
+	 * from the given seed, so runs can be repeated exactly */
+	Simulation(uint32_t seed = 1);
+	virtual ~Simulation();
+
+	/** Returns the virtual time */
+	Clock::time_point now() const {
+		return time;
+	}
+
+	/** Runs the action when the virtual time reaches the given point.
+	 * Actions scheduled for the same time run in the order of scheduling. */
+	void schedule(Clock::time_point when, std::function<void()> action);
+
+	/** Runs the action after the given virtual time */
+	void schedule(Clock::duration delay, std::function<void()> action);
+
+	/** Runs the next event, advancing the virtual time to it. Returns
+	 * false if there is none. */
+	bool step();
+
+	/** Runs every event up to the given time, and advances the clock to it */
+	void runUntil(Clock::time_point when);
+
+	/** Runs every event within the given virtual time */
+	void runFor(Clock::duration duration);
+
+	/** Makes the robot an emulated one, connected to the given address.
+	 * Packets are sent to the robot's listeners, and to the given one. */
+	void attach(Robot &robot, const std::string &address,
+			const EmulationOptions &options = EmulationOptions(),
+			IListener *listener = 0);
+
+	/** Disconnects an emulated robot, dropping the packets in flight */
+	void detach(Robot &robot);
+
+	/** Returns the number of events run so far */
+	uint64_t getProcessedEvents() const {
+		return processed;
+	}
+
+	/** Returns the number of events waiting */
+	size_t getPendingEvents() const {
+		return events.size();
+	}
 };
 
 std::ostream &operator<<(std::ostream &os, const ByteArrayBuffer &packet);
@@ -0,0 +1,493 @@
+/*
+Copyright (C) 2012 Antonio Zea, akzeac@gmail.com, Karlsruhe Institute of Technology
+This code borrows heavily from code by Nicklas Gavelin, nicklas.gavelin@gmail.com,
+Luleå University of Technology
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef LIBSPHERO_COROUTINES_H_
+#define LIBSPHERO_COROUTINES_H_
+
+#if __cplusplus < 202002L
+#error "libSpheroCoroutines.h requires C++20"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <deque>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "libSphero.h"
+
+namespace LibSphero {
+
+namespace Coroutine {
+
+class Executor;
+
+/** A script run by the executor. Scripts start when spawned, and their
+ * frames are freed as soon as they finish. */
+struct Task {
+	struct promise_type {
+		Executor *executor = nullptr;
+
+		Task get_return_object() {
+			return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		std::suspend_always initial_suspend() noexcept {
+			return {};
+		}
+
+		std::suspend_never final_suspend() noexcept {
+			return {};
+		}
+
+		void return_void() {
+		}
+
+		void unhandled_exception() {
+			std::terminate();
+		}
+
+		~promise_type();
+	};
+
+	std::coroutine_handle<promise_type> handle;
+
+	explicit Task(std::coroutine_handle<promise_type> _handle) :
+		handle(_handle) {
+	}
+};
+
+/** Runs scripts on a few threads. Suspended scripts wait in timer and
+ * response queues, so they cost no thread. Robots watched by the executor
+ * are also listened to by its threads. */
+class Executor {
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	/** Identifies a timer, ordered by deadline and then by creation */
+	typedef std::pair<Clock::time_point, uint64_t> TimerId;
+
+private:
+	/** Either a suspended script or a callback run on a worker thread */
+	struct Timer {
+		std::coroutine_handle<> handle;
+		std::function<void()> callback;
+	};
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<std::coroutine_handle<> > ready;
+	std::map<TimerId, Timer> timers;
+	std::vector<std::pair<Robot*, IListener*> > robots;
+	uint64_t timerCount = 0;
+	size_t tasks = 0;
+	bool polling = false;
+	bool stopped = false;
+	int event;
+
+	void wake() {
+		// A full counter means the poller is already signaled
+		uint64_t one = 1;
+		ssize_t written = write(event, &one, sizeof(one));
+		(void) written;
+		changed.notify_all();
+	}
+
+	void work() {
+		std::unique_lock<std::mutex> lock(mutex);
+
+		while (!stopped) {
+			if (!ready.empty()) {
+				std::coroutine_handle<> handle = ready.front();
+				ready.pop_front();
+				lock.unlock();
+				handle.resume();
+				lock.lock();
+				continue;
+			}
+
+			if (tasks == 0) {
+				break;
+			}
+
+			int timeout = -1;
+			if (!timers.empty()) {
+				Clock::time_point now = Clock::now();
+				if (timers.begin()->first.first <= now) {
+					std::vector<std::function<void()> > callbacks;
+					while (!timers.empty() && timers.begin()->first.first <= now) {
+						Timer &timer = timers.begin()->second;
+						if (timer.handle) {
+							ready.push_back(timer.handle);
+						} else {
+							callbacks.push_back(std::move(timer.callback));
+						}
+						timers.erase(timers.begin());
+					}
+					if (!callbacks.empty()) {
+						lock.unlock();
+						for (std::function<void()> &callback : callbacks) {
+							callback();
+						}
+						lock.lock();
+					}
+					continue;
+				}
+				timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+						timers.begin()->first.first - now).count() + 1;
+			}
+
+			// One thread polls the robots, the others wait for work
+			if (polling) {
+				if (timers.empty()) {
+					changed.wait(lock);
+				} else {
+					// Copied, since the timer may be cancelled while waiting
+					Clock::time_point deadline = timers.begin()->first.first;
+					changed.wait_until(lock, deadline);
+				}
+				continue;
+			}
+
+			polling = true;
+			std::vector<std::pair<Robot*, IListener*> > watched = robots;
+			lock.unlock();
+
+			std::vector<pollfd> fds;
+			fds.push_back({ event, POLLIN, 0 });
+			for (const std::pair<Robot*, IListener*> &robot : watched) {
+				fds.push_back({ robot.first->getFileDescriptor(), POLLIN, 0 });
+			}
+
+			::poll(&fds[0], fds.size(), timeout);
+
+			uint64_t count;
+			while (read(event, &count, sizeof(count)) > 0) {
+			}
+			for (size_t i = 1; i < fds.size(); i++) {
+				if (fds[i].revents != 0) {
+					watched[i - 1].first->process(*watched[i - 1].second, 0);
+				}
+			}
+
+			lock.lock();
+			polling = false;
+			changed.notify_all();
+		}
+
+		changed.notify_all();
+	}
+
+public:
+	Executor() {
+		event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	}
+
+	virtual ~Executor() {
+		close(event);
+	}
+
+	/** Starts a script */
+	void spawn(Task task) {
+		std::lock_guard<std::mutex> lock(mutex);
+		task.handle.promise().executor = this;
+		tasks++;
+		ready.push_back(task.handle);
+		wake();
+	}
+
+	/** Lets the executor's threads listen to a robot, passing the packets
+	 * to the given listener */
+	void watch(Robot &robot, IListener &listener) {
+		std::lock_guard<std::mutex> lock(mutex);
+		robots.push_back(std::make_pair(&robot, &listener));
+		wake();
+	}
+
+	/** Resumes a suspended script on one of the executor's threads */
+	void post(std::coroutine_handle<> handle) {
+		std::lock_guard<std::mutex> lock(mutex);
+		ready.push_back(handle);
+		wake();
+	}
+
+	/** Resumes a suspended script once the given time is reached */
+	void postAt(Clock::time_point deadline, std::coroutine_handle<> handle) {
+		std::lock_guard<std::mutex> lock(mutex);
+		timers[TimerId(deadline, timerCount++)] = Timer { handle, nullptr };
+		wake();
+	}
+
+	/** Runs a callback on one of the executor's threads once the given
+	 * time is reached, unless the timer is cancelled first */
+	TimerId callAt(Clock::time_point deadline, std::function<void()> callback) {
+		std::lock_guard<std::mutex> lock(mutex);
+		TimerId id(deadline, timerCount++);
+		timers[id] = Timer { nullptr, std::move(callback) };
+		wake();
+		return id;
+	}
+
+	/** Cancels a callback timer. Does nothing if it has already run. */
+	void cancel(const TimerId &id) {
+		std::lock_guard<std::mutex> lock(mutex);
+		timers.erase(id);
+	}
+
+	/** Runs the scripts on the calling thread plus the given number of
+	 * extra threads, until all of them have finished or stop() is called */
+	void run(unsigned int extraThreads = 0) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopped = false;
+		}
+
+		std::vector<std::thread> threads;
+		for (unsigned int i = 0; i < extraThreads; i++) {
+			threads.push_back(std::thread(&Executor::work, this));
+		}
+		work();
+		for (std::thread &thread : threads) {
+			thread.join();
+		}
+	}
+
+	/** Makes run() return, leaving the remaining scripts suspended */
+	void stop() {
+		std::lock_guard<std::mutex> lock(mutex);
+		stopped = true;
+		wake();
+	}
+
+	/** Called when a script finishes */
+	void finished() {
+		std::lock_guard<std::mutex> lock(mutex);
+		tasks--;
+		wake();
+	}
+
+	/** Suspends the script until the given time */
+	auto sleepUntil(Clock::time_point deadline) {
+		struct Awaiter {
+			Executor &executor;
+			Clock::time_point deadline;
+
+			bool await_ready() const {
+				return Clock::now() >= deadline;
+			}
+
+			void await_suspend(std::coroutine_handle<> handle) {
+				executor.postAt(deadline, handle);
+			}
+
+			void await_resume() {
+			}
+		};
+		return Awaiter { *this, deadline };
+	}
+
+	/** Suspends the script for the given time */
+	template<typename Rep, typename Period>
+	auto sleepFor(std::chrono::duration<Rep, Period> duration) {
+		return sleepUntil(Clock::now()
+				+ std::chrono::duration_cast<Clock::duration>(duration));
+	}
+};
+
+inline Task::promise_type::~promise_type() {
+	if (executor) {
+		executor->finished();
+	}
+}
+
+/** Robot whose commands can be awaited. Every command resumes the script
+ * once the robot acknowledges it, or once the timeout passes. The robot is
+ * listened to by the executor, so listen() must not be called on it. */
+class AsyncRobot : public IListener {
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	/** State shared by a pending command, its response and its timeout */
+	struct Pending {
+		std::atomic<bool> done { false };
+		std::coroutine_handle<> handle;
+		Executor::TimerId timer;
+		Response::Code code = Response::Code::ERROR_TIME_OUT;
+	};
+
+	Executor &executor;
+	Robot &robot;
+	Clock::duration timeout;
+	std::mutex mutex;
+	std::map<int, std::shared_ptr<Pending> > pending;
+
+	/** Resumes the script once, whichever comes first, and drops the
+	 * timeout so it does not outlive the command */
+	void complete(const std::shared_ptr<Pending> &command, Response::Code code) {
+		if (!command->done.exchange(true)) {
+			command->code = code;
+			executor.cancel(command->timer);
+			executor.post(command->handle);
+		}
+	}
+
+	/** Stops waiting for the response to a command, when its timeout
+	 * expires or it could not be sent */
+	void expire(const std::shared_ptr<Pending> &command, int seqNum, Response::Code code) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			std::map<int, std::shared_ptr<Pending> >::iterator it = pending.find(seqNum);
+			if (it != pending.end() && it->second == command) {
+				pending.erase(it);
+			}
+		}
+		complete(command, code);
+	}
+
+public:
+	/** Wraps a robot. Commands not acknowledged within the timeout resume
+	 * the script with ERROR_TIME_OUT. */
+	AsyncRobot(Executor &_executor, Robot &_robot,
+			Clock::duration _timeout = std::chrono::milliseconds(1000)) :
+		executor(_executor),
+		robot(_robot),
+		timeout(_timeout) {
+		executor.watch(robot, *this);
+	}
+
+	/** Cancels the timeouts of the commands still pending. The scripts
+	 * waiting on them are left suspended. */
+	virtual ~AsyncRobot() {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (const std::pair<const int, std::shared_ptr<Pending> > &entry : pending) {
+			executor.cancel(entry.second->timer);
+		}
+	}
+
+	/** Returns the wrapped robot */
+	Robot &getRobot() {
+		return robot;
+	}
+
+	/** Sends a command, resuming the script with the response code, or
+	 * with INVALID if the send queue rejects it */
+	auto send(const Command::Message &message) {
+		struct Awaiter {
+			AsyncRobot &owner;
+			Command::Message message;
+			std::shared_ptr<Pending> command;
+
+			bool await_ready() const {
+				return false;
+			}
+
+			void await_suspend(std::coroutine_handle<> handle) {
+				// Once the command is published, another thread may resume
+				// the script and destroy this awaiter, so only locals are
+				// used from here on
+				AsyncRobot &robot = owner;
+				Command::Message sent = message;
+				std::shared_ptr<Pending> published = std::make_shared<Pending>();
+				published->handle = handle;
+				command = published;
+
+				// Recorded and armed before the response can be processed. The
+				// poller needs the mutex for every response, so it is not held
+				// during the write.
+				int seqNum = robot.robot.reserveSequenceNumber();
+				{
+					std::lock_guard<std::mutex> lock(robot.mutex);
+					published->timer = robot.executor.callAt(Clock::now() + robot.timeout,
+							[&robot, published, seqNum] {
+								robot.expire(published, seqNum, Response::Code::ERROR_TIME_OUT);
+							});
+					robot.pending[seqNum] = published;
+				}
+
+				if (robot.robot.send(sent, seqNum) == -1) {
+					robot.expire(published, seqNum, Response::Code::INVALID);
+				}
+			}
+
+			Response::Code await_resume() {
+				return command->code;
+			}
+		};
+		return Awaiter { *this, message, nullptr };
+	}
+
+	/** Rolls to the given heading (in degrees) and speed (0-255) */
+	auto roll(int heading, uint8_t speed) {
+		heading = ((heading % 360) + 360) % 360;
+		return send(Macro::roll(heading, speed, false));
+	}
+
+	/** Stops the motors */
+	auto stop() {
+		return send(Macro::roll(robot.getHeading(), 0, true));
+	}
+
+	/** Sets the LED RGB color */
+	auto setLEDColor(uint8_t red, uint8_t green, uint8_t blue) {
+		return send(Macro::RGBLED(red, green, blue));
+	}
+
+	/** Sets the brightness of the front LED (0-255) */
+	auto setFrontLEDBrightness(uint8_t brightness) {
+		return send(Macro::setFrontLED(brightness));
+	}
+
+	/** Suspends the script for the given time */
+	template<typename Rep, typename Period>
+	auto sleepFor(std::chrono::duration<Rep, Period> duration) {
+		return executor.sleepFor(duration);
+	}
+
+	virtual void onPacketReceived(const Response::Message &message) {
+		if (message.getResponseType() != Response::Type::REGULAR) {
+			return;
+		}
+
+		std::shared_ptr<Pending> command;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			std::map<int, std::shared_ptr<Pending> >::iterator it =
+					pending.find(message.getSequenceNumber());
+			if (it == pending.end()) {
+				return;
+			}
+			command = it->second;
+			pending.erase(it);
+		}
+		complete(command, message.getResponseCode());
+	}
+};
+
+}
+
+}
+
+#endif /* LIBSPHERO_COROUTINES_H_ */